@@ -3,6 +3,10 @@
 
 #include "collection.h"
 
+//Slab distances can come out a few ulps short in real, far ones are stretched by this much so a ray
+//grazing a box is never culled (Pharr et al., Physically Based Rendering, 3.9.2)
+const real slab_far_slack = 1 + 4 * std::numeric_limits<real>::epsilon();
+
 class aabb
 {
 public:
@@ -15,6 +19,23 @@ public:
 	point3 miny() const { return minimum; }
 	point3 maxy() const { return maximum; }
 
+	point3 centroid() const { return .5 * (minimum + maximum); }
+
+	double surface_area() const
+	{
+		vec3 d = maximum - minimum;
+		return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
+
+	//Grown by a few ulps on every side, so rounding in how the box was computed cannot cut into the object
+	aabb conservative() const
+	{
+		const real ulps = 4 * std::numeric_limits<real>::epsilon();
+		vec3 pad;
+		for (int a = 0; a < 3; a++) pad[a] = ulps * (fmax(fabs(minimum[a]), fabs(maximum[a])) + 1);
+		return aabb(minimum - pad, maximum + pad);
+	}
+
 	//bool hit(const ray& r, double t_min, double t_max) const
 	//{
 	//	for (int i = 0; i < 3; i++)
@@ -34,10 +55,8 @@ public:
 	{
 		for (int i = 0; i < 3; i++)
 		{
-			auto invD = 1.0f / r.direction()[i];
-			auto t0 = (miny()[i] - r.origin()[i]) * invD;
-			auto t1 = (maxy()[i] - r.origin()[i]) * invD;
-			if (invD < 0.0f) std::swap(t0, t1);
+			auto t0 = ((r.sign[i] ? maximum : minimum)[i] - r.orig[i]) * r.inv_dir[i];
+			auto t1 = ((r.sign[i] ? minimum : maximum)[i] - r.orig[i]) * r.inv_dir[i] * slab_far_slack;
 
 			t_min = t0 > t_min ? t0 : t_min;
 			t_max = t1 < t_max ? t1 : t_max;
@@ -3,6 +3,7 @@
 
 #include "collection.h"
 #include "hittable.h"
+#include "material.h"
 
 class xy_rect : public hittable
 {
@@ -11,6 +12,8 @@ public:
 	xy_rect(double _x0, double _x1, double _y0, double _y1, double _z, shared_ptr<material> material) : x0(_x0), x1(_x1), y0(_y0), y1(_y1), z(_z), mat(material) {}
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual void finalize(const ray& r, hit_record& rec) const override;
 
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
 	{
@@ -18,9 +21,13 @@ public:
 		return true;
 	}
 
+	virtual bool emissive() const override { return mat->is_emitter(); }
+	virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
+
 public:
 	shared_ptr<material> mat;
-	double x0, x1, y0, y1, z;
+	real x0, x1, y0, y1, z;
 };
 
 class xz_rect : public hittable
@@ -30,15 +37,21 @@ public:
 	xz_rect(double _x0, double _x1, double _z0, double _z1, double _y, shared_ptr<material> material) : x0(_x0), x1(_x1), z0(_z0), z1(_z1), y(_y), mat(material) {};
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual void finalize(const ray& r, hit_record& rec) const override;
 
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 		output_box = aabb(point3(x0, y - .0001, z0), point3(x1, y + .0001, z1));
 		return true;
 	}
 
+	virtual bool emissive() const override { return mat->is_emitter(); }
+	virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
+
 public:
 	shared_ptr<material> mat;
-	double x0, x1, z0, z1, y;
+	real x0, x1, z0, z1, y;
 };
 
 class yz_rect : public hittable
@@ -48,78 +61,202 @@ public:
 	yz_rect(double _y0, double _y1, double _z0, double _z1, double _x, shared_ptr<material> material) : y0(_y0), y1(_y1), z0(_z0), z1(_z1), x(_x), mat(material) {};
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual void finalize(const ray& r, hit_record& rec) const override;
 
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
 		output_box = aabb(point3(x - .0001, y0, z0), point3(x + .0001, y1, z1));
 		return true;
 	}
 
+	virtual bool emissive() const override { return mat->is_emitter(); }
+	virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
+
 public:
 	shared_ptr<material> mat;
-	double y0, y1, z0, z1, x;
+	real y0, y1, z0, z1, x;
 };
 
+//Converts the area density of a uniformly sampled rectangle to solid angle at origin
+inline double rect_pdf(const vec3& direction, double t, double cosine, double area)
+{
+	auto distance_squared = t * t * direction.length_squared();
+	return distance_squared / (cosine * area);
+}
+
 bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
+	return true;
+}
+
+bool xy_rect::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
 	if (r.direction().z() == 0) return false;
 
 	auto t = (z - r.origin().z()) / r.direction().z();
 	if (t < t_min || t > t_max) return false;
 
-	auto p = r.at(t);
-	if (p.x() < x0 || p.x() > x1 || p.y() < y0 || p.y() > y1) return false;
+	auto x = r.origin().x() + t * r.direction().x();
+	auto y = r.origin().y() + t * r.direction().y();
+	if (x < x0 || x > x1 || y < y0 || y > y1) return false;
+
+	rec.t = t;
+	rec.local[0] = x;
+	rec.local[1] = y;
+	rec.object = this;
+	rec.sampled_light = false;
+	return true;
+}
+
+void xy_rect::finalize(const ray& r, hit_record& rec) const
+{
+	point3 p;
+	p[0] = rec.local[0];
+	p[1] = rec.local[1];
+	p[2] = z; //exactly on the plane, so offset origins leave it
 
 	rec.u = (p.x() - x0) / (x1 - x0);
 	rec.v = (p.y() - y0) / (y1 - y0);
-	rec.t = t;
 	vec3 outward_normal(0.0, 0.0, 1.0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat;
+	rec.mat_ptr = mat.get();
 	rec.p = p;
+	rec.p_scale = 0; //p is exact on the plane axis, its own magnitude bounds the rest
+}
+
+bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	if (!intersect(r, t_min, t_max, rec)) return false;
 
+	finalize_hit(r, rec);
 	return true;
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool xz_rect::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
 	if (r.direction().y() == 0) return false;
 
 	auto t = (y - r.origin().y()) / r.direction().y();
 	if (t < t_min || t > t_max)	return false;
 
-	auto p = r.at(t);
-	if (p.x() < x0 || p.x() > x1 || p.z() < z0 || p.z() > z1) return false;
+	auto x = r.origin().x() + t * r.direction().x();
+	auto z = r.origin().z() + t * r.direction().z();
+	if (x < x0 || x > x1 || z < z0 || z > z1) return false;
+
+	rec.t = t;
+	rec.local[0] = x;
+	rec.local[1] = z;
+	rec.object = this;
+	rec.sampled_light = false;
+	return true;
+}
+
+void xz_rect::finalize(const ray& r, hit_record& rec) const
+{
+	point3 p;
+	p[0] = rec.local[0];
+	p[2] = rec.local[1];
+	p[1] = y;
 
 	rec.u = (p.x() - x0) / (x1 - x0);
 	rec.v = (p.z() - z0) / (z1 - z0);
-	rec.t = t;
 	auto outward_normal = vec3(0.0, 1.0, 0.0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat;
+	rec.mat_ptr = mat.get();
 	rec.p = p;
+	rec.p_scale = 0; //p is exact on the plane axis, its own magnitude bounds the rest
+}
 
+bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
 	return true;
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+bool yz_rect::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
 	if (r.direction().x() == 0) return false;
 
 	auto t = (x - r.origin().x()) / r.direction().x();
 	if (t < t_min || t > t_max) return false;
 
-	auto p = r.at(t);
-	if (p.y() < y0 || p.y() > y1 || p.z() < z0 || p.z() > z1) return false;
+	auto y = r.origin().y() + t * r.direction().y();
+	auto z = r.origin().z() + t * r.direction().z();
+	if (y < y0 || y > y1 || z < z0 || z > z1) return false;
+
+	rec.t = t;
+	rec.local[0] = y;
+	rec.local[1] = z;
+	rec.object = this;
+	rec.sampled_light = false;
+	return true;
+}
+
+void yz_rect::finalize(const ray& r, hit_record& rec) const
+{
+	point3 p;
+	p[1] = rec.local[0];
+	p[2] = rec.local[1];
+	p[0] = x;
 
 	rec.u = (p.y() - y0) / (y1 - y0);
 	rec.v = (p.z() - z0) / (z1 - z0);
-	rec.t = t;
 	auto outward_normal = vec3(1.0, 0.0, 0.0);
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat;
+	rec.mat_ptr = mat.get();
 	rec.p = p;
+	rec.p_scale = 0; //p is exact on the plane axis, its own magnitude bounds the rest
+}
 
-	return true;
+double xy_rect::pdf_value(const point3& origin, const vec3& direction) const
+{
+	hit_record rec;
+	if (!this->hit(ray(origin, direction), 0.0, infinity, rec)) return 0.0;
+
+	return rect_pdf(direction, rec.t, fabs(direction.z()) / direction.length(), (x1 - x0) * (y1 - y0));
+}
+
+vec3 xy_rect::random(const point3& origin) const
+{
+	double r[2];
+	random_doubles(r, 2);
+	return point3(x0 + r[0] * (x1 - x0), y0 + r[1] * (y1 - y0), z) - origin;
+}
+
+double xz_rect::pdf_value(const point3& origin, const vec3& direction) const
+{
+	hit_record rec;
+	if (!this->hit(ray(origin, direction), 0.0, infinity, rec)) return 0.0;
+
+	return rect_pdf(direction, rec.t, fabs(direction.y()) / direction.length(), (x1 - x0) * (z1 - z0));
+}
+
+vec3 xz_rect::random(const point3& origin) const
+{
+	double r[2];
+	random_doubles(r, 2);
+	return point3(x0 + r[0] * (x1 - x0), y, z0 + r[1] * (z1 - z0)) - origin;
+}
+
+double yz_rect::pdf_value(const point3& origin, const vec3& direction) const
+{
+	hit_record rec;
+	if (!this->hit(ray(origin, direction), 0.0, infinity, rec)) return 0.0;
+
+	return rect_pdf(direction, rec.t, fabs(direction.x()) / direction.length(), (y1 - y0) * (z1 - z0));
+}
+
+vec3 yz_rect::random(const point3& origin) const
+{
+	double r[2];
+	random_doubles(r, 2);
+	return point3(x, y0 + r[0] * (y1 - y0), z0 + r[1] * (z1 - z0)) - origin;
 }
 
 #endif
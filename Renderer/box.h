@@ -5,13 +5,19 @@
 #include "aarect.h"
 #include "hittable_list.h"
 
+//Axis-aligned box intersected with one slab test: the face hit is the one of the axis the ray enters through,
+//or leaves through if it starts inside. Uvs are those the six axis-aligned rects of the box gave. Normals point out
+//of the box on every face; the rects' all pointed along +x, +y or +z, so hits on the box_min faces had front_face
+//the wrong way round
 class box : public hittable
 {
 public:
 	box() {}
-	box(const point3& p0, const point3& p1, shared_ptr<material> material);
+	box(const point3& p0, const point3& p1, shared_ptr<material> material) : box_min(p0), box_max(p1), mat_ptr(material) {}
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual void finalize(const ray& r, hit_record& rec) const override;
 
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
 	{
@@ -19,30 +25,93 @@ public:
 		return true;
 	}
 
+	virtual void gather_lights(hittable_list& lights) const override;
+
 public:
 	point3 box_min;
 	point3 box_max;
-	hittable_list sides;
+	shared_ptr<material> mat_ptr;
 };
 
-box::box(const point3& p0, const point3& p1, shared_ptr<material> material)
+bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
+	return true;
+}
+
+//The face hit goes into prim_id as 2 * axis, plus 1 for the face at box_max
+bool box::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
-	box_min = p0;
-	box_max = p1;
+	double t_enter = -infinity, t_exit = infinity;
+	int enter_axis = 0, exit_axis = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		auto t0 = ((r.sign[i] ? box_max : box_min)[i] - r.orig[i]) * r.inv_dir[i];
+		auto t1 = ((r.sign[i] ? box_min : box_max)[i] - r.orig[i]) * r.inv_dir[i];
 
-	sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), material));
-	sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), material));
+		//A ray running inside a face's plane gives NaN there and is decided by the other axes
+		if (t0 > t_enter) { t_enter = t0; enter_axis = i; }
+		if (t1 < t_exit) { t_exit = t1; exit_axis = i; }
+	}
+	if (t_enter > t_exit) return false;
 
-	sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), material));
-	sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), material));
+	//The entry face, or the exit face for rays that start inside
+	if (t_enter >= t_min && t_enter <= t_max)
+	{
+		rec.t = t_enter;
+		rec.prim_id = 2 * enter_axis + (r.sign[enter_axis] != 0);
+	}
+	else if (t_exit >= t_min && t_exit <= t_max)
+	{
+		rec.t = t_exit;
+		rec.prim_id = 2 * exit_axis + (r.sign[exit_axis] == 0);
+	}
+	else return false;
 
-	sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), material));
-	sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), material));
+	rec.object = this;
+	rec.sampled_light = mat_ptr->is_emitter(); //gather_lights() lists its faces in its place
+	return true;
 }
 
-bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+void box::finalize(const ray& r, hit_record& rec) const
 {
-	return sides.hit(r, t_min, t_max, rec);
+	int axis = rec.prim_id / 2;
+	bool far_side = rec.prim_id % 2 != 0;
+
+	rec.p = r.at(rec.t);
+	rec.p[axis] = (far_side ? box_max : box_min)[axis]; //exactly on the face, so offset origins leave it
+	rec.p_scale = 0; //p is exact on the face axis, its own magnitude bounds the rest
+
+	//u and v run along the two other axes in order, as on the rects
+	int u_axis = axis == 0 ? 1 : 0;
+	int v_axis = axis == 2 ? 1 : 2;
+	rec.u = (rec.p[u_axis] - box_min[u_axis]) / (box_max[u_axis] - box_min[u_axis]);
+	rec.v = (rec.p[v_axis] - box_min[v_axis]) / (box_max[v_axis] - box_min[v_axis]);
+
+	vec3 outward_normal(0.0, 0.0, 0.0);
+	outward_normal[axis] = far_side ? 1.0 : -1.0;
+	rec.set_face_normal(r, outward_normal);
+	rec.mat_ptr = mat_ptr.get();
+}
+
+//An emitting box is sampled through its six faces, built only for the light list
+void box::gather_lights(hittable_list& lights) const
+{
+	if (!mat_ptr->is_emitter()) return;
+
+	const point3& p0 = box_min;
+	const point3& p1 = box_max;
+
+	lights.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), mat_ptr));
+	lights.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), mat_ptr));
+
+	lights.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), mat_ptr));
+	lights.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), mat_ptr));
+
+	lights.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), mat_ptr));
+	lights.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), mat_ptr));
 }
 
 #endif
\ No newline at end of file
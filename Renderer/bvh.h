@@ -2,6 +2,10 @@
 #define BVH_H
 
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
 #include "collection.h"
 
 #include "hittable.h"
@@ -9,15 +13,248 @@
 
 //Bounding volume hierarchy
 
+enum class bvh_split_method
+{
+	sah, //binned surface area heuristic
+	random_median //random axis, cut at the median object
+};
+
+struct bvh_build_options
+{
+	bvh_split_method method = bvh_split_method::sah;
+	int max_leaf_size = 4; //a range larger than this is always split
+	int bin_count = 16; //centroid bins per axis, at most bvh_max_bins
+	double traversal_cost = 1.0; //cost of testing a node's box
+	double intersection_cost = 1.0; //cost of one object hit() call
+	int build_threads = 0; //0: one per hardware thread
+};
+
+//Tree quality report, filled in while building
+struct bvh_stats
+{
+	int node_count = 0;
+	int leaf_count = 0;
+	int depth = 0;
+	double sah_cost = 0.0;
+	std::vector<int> leaf_sizes; //leaf_sizes[n]: number of leaves holding n objects
+	double build_seconds = 0.0;
+	size_t allocated_bytes = 0; //held by the builder and the finished tree
+	size_t peak_bytes = 0;
+
+	void add_interior(const aabb& box, int node_depth, const bvh_build_options& options)
+	{
+		node_count++;
+		depth = node_depth + 1 > depth ? node_depth + 1 : depth;
+		sah_cost += options.traversal_cost * box.surface_area();
+	}
+
+	void add_leaf(const aabb& box, int node_depth, size_t size, const bvh_build_options& options)
+	{
+		node_count++;
+		leaf_count++;
+		depth = node_depth + 1 > depth ? node_depth + 1 : depth;
+		sah_cost += options.intersection_cost * size * box.surface_area();
+
+		if (leaf_sizes.size() <= size) leaf_sizes.resize(size + 1, 0);
+		leaf_sizes[size]++;
+	}
+
+	void allocate(size_t bytes)
+	{
+		allocated_bytes += bytes;
+		peak_bytes = allocated_bytes > peak_bytes ? allocated_bytes : peak_bytes;
+	}
+
+	void release(size_t bytes)
+	{
+		allocated_bytes -= bytes;
+	}
+
+	void merge(const bvh_stats& other) //adds a subtree built with its own stats on another thread
+	{
+		node_count += other.node_count;
+		leaf_count += other.leaf_count;
+		depth = other.depth > depth ? other.depth : depth;
+		sah_cost += other.sah_cost;
+
+		if (leaf_sizes.size() < other.leaf_sizes.size()) leaf_sizes.resize(other.leaf_sizes.size(), 0);
+		for (size_t i = 0; i < other.leaf_sizes.size(); i++) leaf_sizes[i] += other.leaf_sizes[i];
+
+		peak_bytes = allocated_bytes + other.peak_bytes > peak_bytes ? allocated_bytes + other.peak_bytes : peak_bytes;
+		allocate(other.allocated_bytes);
+	}
+
+	void finish(const aabb& root_box) //normalizes the accumulated areas by the root's
+	{
+		auto area = root_box.surface_area();
+		sah_cost = area > 0.0 ? sah_cost / area : 0.0;
+	}
+
+	void report(std::ostream& out) const
+	{
+		out << "BVH: " << node_count << " nodes, " << leaf_count << " leaves, depth " << depth << ", SAH cost " << sah_cost << '\n';
+		out << "Built in " << build_seconds * 1000.0 << "ms, peak build memory " << peak_bytes / 1024 << "KiB\n";
+		out << "Leaf sizes:";
+		for (size_t i = 1; i < leaf_sizes.size(); i++)
+		{
+			if (leaf_sizes[i] > 0) out << ' ' << i << 'x' << leaf_sizes[i];
+		}
+		out << '\n';
+	}
+};
+
+//Traversal counters, one set per thread. Defining RENDERER_TRAVERSAL_STATS in the project's preprocessor
+//definitions counts what the BVHs fetch and test while rays traverse them; without it the counting compiles away.
+//Fetches are also run through a model of a 32 KiB data cache, 512 direct mapped lines, since reordering rays changes
+//which nodes are still cached rather than how many a ray visits
+struct traversal_stats
+{
+	uint64_t queries = 0; //closest and any hit queries, counted by the outermost tree only
+	uint64_t node_fetches = 0; //nodes read, in every tree a query passes through
+	uint64_t node_misses = 0; //fetches whose node was not in the model cache
+	uint64_t primitive_tests = 0; //objects in the leaves reached; an any hit query may stop partway through one
+	int nesting = 0; //trees being traversed on this thread, instanced geometry has its own inside the scene's
+
+	void merge(const traversal_stats& other)
+	{
+		queries += other.queries;
+		node_fetches += other.node_fetches;
+		node_misses += other.node_misses;
+		primitive_tests += other.primitive_tests;
+	}
+
+	void report(std::ostream& out) const
+	{
+		if (queries == 0) return;
+		out << "Traversal: " << double(node_fetches) / queries << " node fetches (" << double(node_misses) / queries << " cache misses), "
+			<< double(primitive_tests) / queries << " primitive tests per ray\n";
+	}
+};
+
+const int traversal_cache_lines = 512;
+
+inline traversal_stats& thread_traversal_stats()
+{
+	thread_local traversal_stats stats;
+	return stats;
+}
+
+inline void count_node_fetch(const void* node)
+{
+#ifdef RENDERER_TRAVERSAL_STATS
+	thread_local uintptr_t cache[traversal_cache_lines] = {};
+	uintptr_t line = reinterpret_cast<uintptr_t>(node) >> 6;
+	uintptr_t& slot = cache[line % traversal_cache_lines];
+
+	traversal_stats& stats = thread_traversal_stats();
+	stats.node_fetches++;
+	if (slot != line) stats.node_misses++;
+	slot = line;
+#endif
+}
+
+inline void count_primitive_tests(uint64_t count)
+{
+#ifdef RENDERER_TRAVERSAL_STATS
+	thread_traversal_stats().primitive_tests += count;
+#endif
+}
+
+//Counts count queries for the length of a traversal, unless it runs inside another tree's
+class counted_query
+{
+public:
+	counted_query(uint64_t count)
+	{
+#ifdef RENDERER_TRAVERSAL_STATS
+		traversal_stats& stats = thread_traversal_stats();
+		if (stats.nesting++ == 0) stats.queries += count;
+#endif
+	}
+
+	~counted_query()
+	{
+#ifdef RENDERER_TRAVERSAL_STATS
+		thread_traversal_stats().nesting--;
+#endif
+	}
+
+	counted_query(const counted_query&) = delete;
+	counted_query& operator=(const counted_query&) = delete;
+};
+
+const int bvh_max_bins = 64;
+
+//Traversal stacks are fixed arrays sized for bvh_max_depth levels. Skewed centroids can make the cost sweep peel
+//off a few objects per level, so ranges at bvh_median_depth and below are cut at their object median instead:
+//halving takes even 2^32 objects down to single leaves in the remaining 32 levels
+const int bvh_max_depth = 64;
+const int bvh_median_depth = bvh_max_depth - 32;
+const size_t bvh_parallel_min_objects = 4096; //smaller subtrees are not worth a thread
+
+//Number of tree levels whose subtrees are built on separate threads
+int bvh_parallel_depth(const bvh_build_options& options)
+{
+	if (options.method == bvh_split_method::random_median) return 0; //a new thread's random axes would differ from the serial build's
+
+	int threads = options.build_threads > 0 ? options.build_threads : static_cast<int>(std::thread::hardware_concurrency());
+	int depth = 0;
+	while ((1 << depth) < threads) depth++;
+	return depth;
+}
+
+//Cached bounds of one object; the builder only ever reorders these
+struct bvh_primitive
+{
+	aabb box;
+	point3 centroid;
+	uint32_t index; //position in the source object array
+};
+
+std::vector<bvh_primitive> make_bvh_primitives(const std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, double time0, double time1, bvh_stats* stats)
+{
+	std::vector<bvh_primitive> prims(end - start);
+	if (stats) stats->allocate(prims.capacity() * sizeof(bvh_primitive));
+
+	for (size_t i = start; i < end; i++)
+	{
+		auto& prim = prims[i - start];
+		if (!objects[i]->bounding_box(time0, time1, prim.box))
+		{
+			std::cerr << "No bounding box in bvh constructor.\n";
+		}
+		prim.box = prim.box.conservative();
+		prim.centroid = prim.box.centroid();
+		prim.index = static_cast<uint32_t>(i);
+	}
+
+	return prims;
+}
+
+aabb bvh_bounds(const std::vector<bvh_primitive>& prims, size_t start, size_t end)
+{
+	aabb output_box = prims[start].box;
+	for (size_t i = start + 1; i < end; i++) output_box = surrounding_box(output_box, prims[i].box);
+	return output_box;
+}
+
 class bvh_node : public hittable
 {
 public:
 	bvh_node() {}
-	bvh_node(const hittable_list& list, double time0, double time1) : bvh_node(list.objects, 0, list.objects.size(), time0, time1) {}
-	bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1);
+	bvh_node(const hittable_list& list, double time0, double time1, const bvh_build_options& options = bvh_build_options(), bvh_stats* stats = nullptr)
+		: bvh_node(list.objects, 0, list.objects.size(), time0, time1, options, stats) {}
+	bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1,
+		const bvh_build_options& options = bvh_build_options(), bvh_stats* stats = nullptr);
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual void gather_lights(hittable_list& lights) const override;
+
+	void build(const std::vector<shared_ptr<hittable>>& objects, std::vector<bvh_primitive>& prims, size_t start, size_t end,
+		const bvh_build_options& options, bvh_stats* stats, int depth, int parallel_depth);
 
 public:
 	shared_ptr<hittable> left;
@@ -25,94 +262,282 @@ public:
 	aabb box;
 };
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis)
+inline bool box_compare(const bvh_primitive& a, const bvh_primitive& b, int axis)
 {
-	aabb box_a, box_b;
-
-	if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-	{
-		std::cerr << "No bounding box in bvh_node constructor.\n";
-	}
-
-	return box_a.miny().e[axis] < box_b.miny().e[axis];
+	return a.box.miny().e[axis] < b.box.miny().e[axis];
 }
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+bool box_x_compare(const bvh_primitive& a, const bvh_primitive& b)
 {
 	return box_compare(a, b, 0);
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+bool box_y_compare(const bvh_primitive& a, const bvh_primitive& b)
 {
 	return box_compare(a, b, 1);
 }
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+bool box_z_compare(const bvh_primitive& a, const bvh_primitive& b)
 {
 	return box_compare(a, b, 2);
 }
 
-bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1)
+struct bvh_bin
 {
-	auto objects = src_objects; //Create a modifiable array of source scene objects
+	aabb box;
+	int count;
+};
 
-	int axis = random_int(0, 2);
-	auto comparator = (axis == 0) ? box_x_compare
-		: (axis == 1) ? box_y_compare
-		: box_z_compare;
+//Reorders prims[start, end), the range of a node at depth, into two children and returns true, or returns false if
+//the range should stay a leaf
+bool bvh_split(std::vector<bvh_primitive>& prims, size_t start, size_t end, int depth, const bvh_build_options& options, size_t& mid, int& split_axis)
+{
+	size_t object_span = end - start;
+	if (object_span <= 1) return false;
 
+	if (depth >= bvh_median_depth)
+	{
+		if (object_span <= static_cast<size_t>(options.max_leaf_size)) return false;
 
-	size_t object_span = end - start;
+		aabb centroid_bounds(prims[start].centroid, prims[start].centroid);
+		for (size_t i = start + 1; i < end; i++) centroid_bounds = surrounding_box(centroid_bounds, aabb(prims[i].centroid, prims[i].centroid));
+		vec3 extent = centroid_bounds.maxy() - centroid_bounds.miny();
+		split_axis = extent.x() >= extent.y() && extent.x() >= extent.z() ? 0 : extent.y() >= extent.z() ? 1 : 2;
+
+		mid = start + object_span / 2;
+		std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+			[&](const bvh_primitive& a, const bvh_primitive& b) { return a.centroid[split_axis] < b.centroid[split_axis]; });
+		return true;
+	}
 
-	if (object_span == 1)
+	if (options.method == bvh_split_method::random_median)
 	{
-		left = right = objects[start];
+		if (object_span == 2) return false;
+
+		split_axis = random_int(0, 2);
+		auto comparator = (split_axis == 0) ? box_x_compare
+			: (split_axis == 1) ? box_y_compare
+			: box_z_compare;
+
+		std::sort(prims.begin() + start, prims.begin() + end, comparator);
+		mid = start + object_span / 2;
+		return true;
 	}
-	else if (object_span == 2)
+
+	//Bounds of the node and of the object centroids
+	aabb bounds = prims[start].box;
+	aabb centroid_bounds(prims[start].centroid, prims[start].centroid);
+	for (size_t i = start + 1; i < end; i++)
 	{
-		if (comparator(objects[start], objects[start + 1]))
+		bounds = surrounding_box(bounds, prims[i].box);
+		centroid_bounds = surrounding_box(centroid_bounds, aabb(prims[i].centroid, prims[i].centroid));
+	}
+
+	//Sweep the bin boundaries of every axis for the cheapest split plane
+	const int bin_count = options.bin_count < 2 ? 2 : options.bin_count > bvh_max_bins ? bvh_max_bins : options.bin_count;
+	bvh_bin bins[bvh_max_bins];
+	double right_area[bvh_max_bins];
+	int right_count[bvh_max_bins];
+
+	auto bin_index = [&](const point3& centroid, int axis)
+	{
+		auto extent = centroid_bounds.maxy()[axis] - centroid_bounds.miny()[axis];
+		int index = static_cast<int>(bin_count * (centroid[axis] - centroid_bounds.miny()[axis]) / extent);
+		return index < bin_count ? index : bin_count - 1;
+	};
+
+	double best_cost = infinity;
+	int best_axis = -1;
+	int best_plane = 0; //objects in bins below this go to the left child
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		if (centroid_bounds.maxy()[axis] <= centroid_bounds.miny()[axis]) continue;
+
+		for (int i = 0; i < bin_count; i++) bins[i].count = 0;
+		for (size_t i = start; i < end; i++)
+		{
+			auto& bin = bins[bin_index(prims[i].centroid, axis)];
+			bin.box = bin.count == 0 ? prims[i].box : surrounding_box(bin.box, prims[i].box);
+			bin.count++;
+		}
+
+		aabb accum;
+		int count = 0;
+		for (int i = bin_count - 1; i > 0; i--)
 		{
-			left = objects[start];
-			right = objects[start + 1];
+			if (bins[i].count > 0)
+			{
+				accum = count == 0 ? bins[i].box : surrounding_box(accum, bins[i].box);
+				count += bins[i].count;
+			}
+			right_area[i] = count > 0 ? accum.surface_area() : 0.0;
+			right_count[i] = count;
+		}
+
+		count = 0;
+		for (int i = 1; i < bin_count; i++)
+		{
+			if (bins[i - 1].count > 0)
+			{
+				accum = count == 0 ? bins[i - 1].box : surrounding_box(accum, bins[i - 1].box);
+				count += bins[i - 1].count;
+			}
+			if (count == 0 || right_count[i] == 0) continue;
+
+			auto cost = options.traversal_cost + options.intersection_cost * (count * accum.surface_area() + right_count[i] * right_area[i]) / bounds.surface_area();
+			if (cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = axis;
+				best_plane = i;
+			}
+		}
+	}
+
+	bool fits_leaf = object_span <= static_cast<size_t>(options.max_leaf_size);
+	if (best_axis < 0) //all centroids coincide, no plane separates them
+	{
+		if (fits_leaf) return false;
+
+		mid = start + object_span / 2;
+		split_axis = 0;
+		return true;
+	}
+	if (fits_leaf && options.intersection_cost * object_span <= best_cost) return false;
+
+	auto split = std::partition(prims.begin() + start, prims.begin() + end,
+		[&](const bvh_primitive& prim) { return bin_index(prim.centroid, best_axis) < best_plane; });
+
+	mid = split - prims.begin();
+	split_axis = best_axis;
+	return true;
+}
+
+bvh_node::bvh_node(const std::vector<shared_ptr<hittable>>& src_objects, size_t start, size_t end, double time0, double time1,
+	const bvh_build_options& options, bvh_stats* stats)
+{
+	auto start_time = std::chrono::steady_clock::now();
+
+	//All levels share this one reference array, the source objects are never copied
+	auto prims = make_bvh_primitives(src_objects, start, end, time0, time1, stats);
+	build(src_objects, prims, 0, prims.size(), options, stats, 0, bvh_parallel_depth(options));
+
+	if (stats)
+	{
+		stats->release(prims.capacity() * sizeof(bvh_primitive));
+		stats->finish(box);
+		stats->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	}
+}
+
+void bvh_node::build(const std::vector<shared_ptr<hittable>>& objects, std::vector<bvh_primitive>& prims, size_t start, size_t end,
+	const bvh_build_options& options, bvh_stats* stats, int depth, int parallel_depth)
+{
+	size_t object_span = end - start;
+	size_t mid;
+	int axis;
+	bool leaf = !bvh_split(prims, start, end, depth, options, mid, axis);
+
+	box = bvh_bounds(prims, start, end);
+
+	if (!leaf)
+	{
+		auto left_node = make_shared<bvh_node>();
+		auto right_node = make_shared<bvh_node>();
+		if (stats) stats->allocate(2 * sizeof(bvh_node));
+
+		if (depth < parallel_depth && object_span >= bvh_parallel_min_objects)
+		{
+			//The children own disjoint ranges of prims, so the left one can be built alongside
+			bvh_stats left_stats;
+			bvh_stats* left_stats_ptr = stats ? &left_stats : nullptr;
+			std::thread left_thread([&]() { left_node->build(objects, prims, start, mid, options, left_stats_ptr, depth + 1, parallel_depth); });
+			right_node->build(objects, prims, mid, end, options, stats, depth + 1, parallel_depth);
+			left_thread.join();
+
+			if (stats) stats->merge(left_stats);
 		}
 		else
 		{
-			left = objects[start + 1];
-			right = objects[start];
+			left_node->build(objects, prims, start, mid, options, stats, depth + 1, parallel_depth);
+			right_node->build(objects, prims, mid, end, options, stats, depth + 1, parallel_depth);
 		}
+		left = left_node;
+		right = right_node;
+	}
+	else if (object_span == 1)
+	{
+		left = right = objects[prims[start].index];
+	}
+	else if (object_span == 2)
+	{
+		left = objects[prims[start].index];
+		right = objects[prims[start + 1].index];
 	}
 	else
 	{
-		std::sort(objects.begin() + start, objects.begin() + end, comparator);
+		auto list = make_shared<hittable_list>();
+		list->objects.reserve(object_span);
+		for (size_t i = start; i < end; i++) list->add(objects[prims[i].index]);
+		left = right = list;
 
-		auto mid = start + object_span / 2;
-		left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-		right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+		if (stats) stats->allocate(sizeof(hittable_list) + object_span * sizeof(shared_ptr<hittable>));
 	}
 
-	aabb box_left, box_right;
-	if (!left->bounding_box(time0, time1, box_left) || !right->bounding_box(time0, time1, box_right))
+	if (stats)
 	{
-		std::cerr << "No bounding box in bvh_node constructor.\n";
+		if (leaf) stats->add_leaf(box, depth, object_span, options);
+		else stats->add_interior(box, depth, options);
 	}
-
-	box = surrounding_box(box_left, box_right);
 }
 
 bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
+	return true;
+}
+
+bool bvh_node::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	counted_query query(1);
+	count_node_fetch(this);
 	if (!box.hit(r, t_min, t_max)) return false;
 
-	bool hit_left = left->hit(r, t_min, t_max, rec);
-	bool hit_right = right->hit(r, t_min, t_max, rec);
+	bool hit_left = left->intersect(r, t_min, t_max, rec);
+	if (hit_left && left->emissive()) rec.sampled_light = true; //gather_lights() lists it
+	bool hit_right = right != left && right->intersect(r, t_min, hit_left ? rec.t : t_max, rec);
+	if (hit_right && right->emissive()) rec.sampled_light = true;
 
 	return hit_left || hit_right;
 }
 
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const
+{
+	counted_query query(1);
+	count_node_fetch(this);
+	if (!box.hit(r, t_min, t_max)) return false;
+
+	return left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max));
+}
+
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
 {
 	output_box = box;
 	return true;
 }
 
+void bvh_node::gather_lights(hittable_list& lights) const
+{
+	if (left->emissive()) lights.add(left);
+	else left->gather_lights(lights);
+
+	if (right == left) return; //single object leaf
+
+	if (right->emissive()) lights.add(right);
+	else right->gather_lights(lights);
+}
+
 #endif
\ No newline at end of file
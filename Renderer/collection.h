@@ -5,6 +5,7 @@
 #include <limits>
 #include <memory>
 #include <cstdlib>
+#include <cstdint>
 
 
 // Usings
@@ -13,6 +14,16 @@ using std::make_shared;
 using std::sqrt;
 
 
+// Precision
+// Geometry and colours are stored as real: double by default, for validation renders. Defining
+// RENDERER_SINGLE_PRECISION in the project's preprocessor definitions switches them to float for throughput
+#ifdef RENDERER_SINGLE_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
+
+
 // Constants
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
@@ -29,9 +40,85 @@ inline double rad2deg(double rad)
 	return rad / pi * 180.0;
 }
 
+// Random Numbers
+// Four independent PCG32 streams (pcg-random.org) stepped together. The lanes never
+// depend on each other, so the refill loop vectorizes and one refill serves four draws.
+class pcg32x4
+{
+public:
+	static const int lanes = 4;
+
+	pcg32x4() { seed(0); }
+
+	void seed(uint64_t seed_value)
+	{
+		for (int i = 0; i < lanes; i++)
+		{
+			inc[i] = (splitmix64(seed_value + i) << 1) | 1;
+			state[i] = splitmix64(seed_value ^ (0x9e3779b97f4a7c15ULL * (i + 1))) + inc[i];
+		}
+		available = 0;
+	}
+
+	double next_double()
+	{
+		if (available == 0) refill();
+		return buffer[--available];
+	}
+
+	void fill(double* out, int count)
+	{
+		for (int i = 0; i < count; i++) out[i] = next_double();
+	}
+
+private:
+	uint64_t state[lanes];
+	uint64_t inc[lanes];
+	double buffer[lanes];
+	int available;
+
+	void refill()
+	{
+		for (int i = 0; i < lanes; i++)
+		{
+			uint64_t old = state[i];
+			state[i] = old * 6364136223846793005ULL + inc[i];
+			uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+			uint32_t rot = static_cast<uint32_t>(old >> 59);
+			uint32_t value = (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+			buffer[i] = value * (1.0 / 4294967296.0);
+		}
+		available = lanes;
+	}
+
+	static uint64_t splitmix64(uint64_t x)
+	{
+		x += 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+};
+
+inline pcg32x4& thread_rng() //every thread owns its generator, so sampling never contends
+{
+	thread_local pcg32x4 rng;
+	return rng;
+}
+
+inline void seed_random(uint64_t seed) //seeding per pixel keeps renders independent of the thread count
+{
+	thread_rng().seed(seed);
+}
+
 inline double random_double()
 {
-	return rand() / (RAND_MAX + 1.0);
+	return thread_rng().next_double();
+}
+
+inline void random_doubles(double* out, int count)
+{
+	thread_rng().fill(out, count);
 }
 
 inline double random_double(double min, double max)
@@ -51,6 +138,32 @@ inline double clamp(double x, double min, double max)
 	return x;
 }
 
+// Memory
+// Allocator for types declared alignas() above 16 bytes; operator new only honours that from C++17 on,
+// so a plain vector of them may hand out misaligned elements
+template <typename T>
+struct aligned_allocator
+{
+	typedef T value_type;
+
+	aligned_allocator() {}
+	template <typename U> aligned_allocator(const aligned_allocator<U>&) {}
+
+	T* allocate(size_t n)
+	{
+		//The pointer operator new returned is kept just below the aligned block
+		void* raw = ::operator new(n * sizeof(T) + alignof(T) + sizeof(void*));
+		uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + sizeof(void*) + alignof(T) - 1) & ~uintptr_t(alignof(T) - 1);
+		reinterpret_cast<void**>(aligned)[-1] = raw;
+		return reinterpret_cast<T*>(aligned);
+	}
+
+	void deallocate(T* p, size_t) { ::operator delete(reinterpret_cast<void**>(p)[-1]); }
+};
+
+template <typename T, typename U> bool operator==(const aligned_allocator<T>&, const aligned_allocator<U>&) { return true; }
+template <typename T, typename U> bool operator!=(const aligned_allocator<T>&, const aligned_allocator<U>&) { return false; }
+
 
 // Common Headers
 #include "ray.h"
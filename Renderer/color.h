@@ -25,15 +25,10 @@ const double ACESOutputMat[3][3] =
 };
 color mul(const double matrix[3][3], color c)
 {
-	color output = color(0);
-	for (int y = 0; y < 3; y++)
-	{
-		for (int x = 0; x < 3; x++)
-		{
-			output.e[y] += matrix[x][y] * c.e[x];
-		}
-	}
-	return output;
+	//Sum of the matrix rows weighted by the channels, three whole-vector multiply-adds instead of nine scalar ones
+	return c.x() * color(matrix[0][0], matrix[0][1], matrix[0][2])
+		+ c.y() * color(matrix[1][0], matrix[1][1], matrix[1][2])
+		+ c.z() * color(matrix[2][0], matrix[2][1], matrix[2][2]);
 }
 color RRTandODTfit(color v)
 {
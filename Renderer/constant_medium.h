@@ -48,7 +48,7 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
 	rec1.t = fmax(0.0, rec1.t);
 
-	const auto ray_length = r.direction().length();
+	const auto ray_length = r.dir_length;
 	const auto distance_inside_boundry = (rec2.t - rec1.t) * ray_length;
 	const auto hit_distance = neg_inv_density * log(random_double());
 
@@ -56,12 +56,14 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
 	rec.t = rec1.t + hit_distance / ray_length;
 	rec.p = r.at(rec.t);
+	rec.p_scale = 0;
 
 	if (debugging) std::cerr << "hit_distance = " << hit_distance << '\n' << "rec.t = " << rec.t << '\n' << "rec.p = " << rec.p << '\n';
 
 	rec.normal = vec3(1.0, 0.0, 0.0); //arbitrary
 	rec.front_face = true; //also arbitrary
-	rec.mat_ptr = phase_function;
+	rec.mat_ptr = phase_function.get();
+	rec.sampled_light = false;
 
 	return true;
 }
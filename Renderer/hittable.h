@@ -6,15 +6,24 @@
 #include "aabb.h"
 
 class material;
+class hittable;
+class hittable_list;
 
 struct hit_record
 {
 	point3 p;
 	vec3 normal;
-	shared_ptr<material> mat_ptr;
+	const material* mat_ptr; //non-owning, the hit object keeps its material alive
 	double t;
 	double u, v;
 	bool front_face;
+	real p_scale = 0; //largest magnitude p was computed from (e.g. a sphere's center), bounds its rounding error
+	bool sampled_light = false; //the object hit is in the light list, so light sampling could have found this point too
+
+	//Left by hittable::intersect() for the object's finalize(), which derives everything above but t from them
+	const hittable* object = nullptr; //null once the record is complete
+	uint32_t prim_id = 0; //e.g. the triangle of a mesh
+	double local[2]; //barycentrics or coordinates on the surface, whichever the object needs
 
 	inline void set_face_normal(const ray& r, const vec3& outward_normal)
 	{
@@ -23,19 +32,73 @@ struct hit_record
 	}
 };
 
+inline real max_magnitude(const vec3& v)
+{
+	return fmax(fabs(v.x()), fmax(fabs(v.y()), fabs(v.z())));
+}
+
+//Moves a hit point off the surface, to the side a ray leaving in direction is on. The offset is a fixed number of
+//ulps of the values the point was computed from, so it holds in float as in double; rays start from here with
+//t_min = 0 instead of relying on a fixed epsilon that is too big for thin geometry and too small far from the origin
+inline point3 offset_ray_origin(const hit_record& rec, const vec3& direction)
+{
+	const real ulps = 64 * std::numeric_limits<real>::epsilon();
+	real offset = ulps * (fmax(max_magnitude(rec.p), rec.p_scale) + 1);
+
+	return dot(direction, rec.normal) > 0 ? rec.p + offset * rec.normal : rec.p - offset * rec.normal;
+}
+
 class hittable
 {
 public:
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+	//hit() in two phases: intersect() finds the closest hit but only records t and what finalize() needs, so the
+	//shading data (point, normal, uvs, material) is worked out once, for the hit that won, instead of for every
+	//candidate. Containers compare candidates with intersect(); the defaults do all of hit() in the first phase.
+	//Both only write to rec when they return true, so containers can collect candidates straight into it
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
+	{
+		if (!hit(r, t_min, t_max, rec)) return false;
+
+		rec.object = nullptr;
+		rec.sampled_light = false; //objects without their own intersect() pass on no lights
+		return true;
+	}
+	virtual void finalize(const ray& r, hit_record& rec) const {}
+
+	//Any-hit query for shadow and visibility rays: whether anything is hit between t_min and t_max. Containers stop
+	//at the first hit they find, and no shading data is worked out; the default is intersect() without finalize()
+	virtual bool occluded(const ray& r, double t_min, double t_max) const
+	{
+		hit_record rec;
+		return intersect(r, t_min, t_max, rec);
+	}
+
+	//Light sampling, only shapes that can be used as lights override these. hit_record::sampled_light follows what
+	//gather_lights() collects: primitives clear it on every hit, containers set it on hits of the emissive children
+	//they gather, and objects that do not pass gather_lights() on (wrappers, instances, media) clear it again
+	virtual bool emissive() const { return false; }
+	virtual double pdf_value(const point3& origin, const vec3& direction) const { return 0.0; } //solid angle density of random(origin)
+	virtual vec3 random(const point3& origin) const { return vec3(1.0, 0.0, 0.0); } //direction from origin towards a point on the shape
+	virtual void gather_lights(hittable_list& lights) const {} //containers add their emissive children
 };
 
+//Completes a record intersect() returned, r is the ray it was found along
+inline void finalize_hit(const ray& r, hit_record& rec)
+{
+	if (rec.object) rec.object->finalize(r, rec);
+	rec.object = nullptr;
+}
+
 class translate : public hittable
 {
 public:
 	translate(shared_ptr<hittable> object, const vec3& displacement) : obj(object), offset(displacement) {}
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
 public:
@@ -45,15 +108,22 @@ public:
 
 bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
-	ray moved_ray(r.origin() - offset, r.direction(), r.time());
+	ray moved_ray = r.moved_to(r.origin() - offset);
 	if (!obj->hit(moved_ray, t_min, t_max, rec)) return false;
 
+	//Moving the object changes neither its normal nor which side of it the ray came from, so rec.front_face stands
+	rec.sampled_light = false; //lights are not gathered through transforms
+	rec.p_scale = fmax(rec.p_scale, max_magnitude(rec.p)) + max_magnitude(offset);
 	rec.p += offset;
-	rec.set_face_normal(moved_ray, rec.normal);
 
 	return true;
 }
 
+bool translate::occluded(const ray& r, double t_min, double t_max) const
+{
+	return obj->occluded(r.moved_to(r.origin() - offset), t_min, t_max);
+}
+
 bool translate::bounding_box(double time0, double time1, aabb& output_box) const
 {
 	if (!obj->bounding_box(time0, time1, output_box)) return false;
@@ -143,8 +213,11 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 	normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
 	normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
 
+	//The inner hit already turned the normal against the ray and set front_face; rotating both keeps that true
+	rec.sampled_light = false;
+	rec.p_scale = fmax(rec.p_scale, max_magnitude(rec.p));
 	rec.p = p;
-	rec.set_face_normal(rotated_ray, normal);
+	rec.normal = normal;
 
 	return true;
 }
@@ -19,31 +19,55 @@ public:
 	void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+	//As a light list: picks one member uniformly, so the density is the members' average
+	virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
+	virtual void gather_lights(hittable_list& lights) const override;
+
 public:
 	std::vector<shared_ptr<hittable>> objects;
 };
 
 bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
-	hit_record best_rec;
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
+	return true;
+}
+
+bool hittable_list::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
 	bool global_hit = false; //false if ray doesn't hit anything
 	auto closest_hit = t_max;
 
 	for (const auto& obj : objects)
 	{
-		if (obj->hit(r, t_min, closest_hit, best_rec))
+		if (obj->intersect(r, t_min, closest_hit, rec))
 		{
 			global_hit = true;
-			closest_hit = best_rec.t;
-			rec = best_rec;
+			closest_hit = rec.t;
+			if (obj->emissive()) rec.sampled_light = true; //gather_lights() lists it
 		}
 	}
 
 	return global_hit;
 }
 
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const
+{
+	for (const auto& obj : objects)
+	{
+		if (obj->occluded(r, t_min, t_max)) return true;
+	}
+
+	return false;
+}
+
 bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const
 {
 	if (objects.empty()) return false;
@@ -61,4 +85,28 @@ bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) c
 	return true;
 }
 
+double hittable_list::pdf_value(const point3& origin, const vec3& direction) const
+{
+	if (objects.empty()) return 0.0;
+
+	double sum = 0.0;
+	for (const auto& object : objects) sum += object->pdf_value(origin, direction);
+
+	return sum / objects.size();
+}
+
+vec3 hittable_list::random(const point3& origin) const
+{
+	return objects[random_int(0, static_cast<int>(objects.size()) - 1)]->random(origin);
+}
+
+void hittable_list::gather_lights(hittable_list& lights) const
+{
+	for (const auto& object : objects)
+	{
+		if (object->emissive()) lights.add(object);
+		else object->gather_lights(lights);
+	}
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,206 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include "collection.h"
+
+#include "hittable.h"
+#include "linear_bvh.h"
+#include "transform.h"
+
+//Where one copy of a shared object sits in the world. The inverse is kept alongside, since rays go into object
+//space and hits come back out
+struct placement
+{
+	placement() {}
+	placement(uint32_t _object, const affine3& transform) : to_world(transform), to_object(transform.inverse()), object(_object) {}
+
+	ray object_ray(const ray& r) const
+	{
+		return ray(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
+	}
+
+	//Takes a hit found along object_ray(r) back to world space. t is unchanged, the direction was not renormalized
+	void world_hit(hit_record& rec) const
+	{
+		rec.p_scale = fabs(to_world.m[0][3]) + fabs(to_world.m[1][3]) + fabs(to_world.m[2][3])
+			+ to_world.max_stretch() * fmax(rec.p_scale, max_magnitude(rec.p));
+		rec.p = to_world.point(rec.p);
+		rec.normal = unit_vector(to_object.transposed_vector(rec.normal)); //keeps the side it faced the ray on, and so front_face
+		rec.sampled_light = false; //placements are never gathered as lights, whatever the shared object is elsewhere
+	}
+
+	affine3 to_world;
+	affine3 to_object;
+	uint32_t object; //index into the shared objects
+};
+
+//One transformed copy of an object, for a few placed objects in an ordinary list. Many copies of the same
+//objects belong in an instance_set, which keeps the transforms in one array under a BVH of their own
+class instance : public hittable
+{
+public:
+	instance(shared_ptr<hittable> object, const affine3& transform);
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+public:
+	shared_ptr<hittable> obj;
+	placement place;
+	bool hasbox;
+	aabb box;
+};
+
+instance::instance(shared_ptr<hittable> object, const affine3& transform) : obj(object), place(0, transform)
+{
+	hasbox = obj->bounding_box(0.0, 1.0, box);
+	if (hasbox) box = place.to_world.box(box);
+}
+
+bool instance::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	if (!obj->hit(place.object_ray(r), t_min, t_max, rec)) return false;
+
+	place.world_hit(rec);
+	return true;
+}
+
+bool instance::occluded(const ray& r, double t_min, double t_max) const
+{
+	return obj->occluded(place.object_ray(r), t_min, t_max);
+}
+
+bool instance::bounding_box(double time0, double time1, aabb& output_box) const
+{
+	if (!hasbox) return false;
+
+	output_box = box;
+	return true;
+}
+
+//Top level of a two-level hierarchy: many placements of a few shared objects (the bottom-level BVHs, meshes or
+//plain shapes), under a flattened BVH over the placements' world boxes. A copy costs one placement, so the scene
+//can hold millions of them while the geometry is stored once per object
+class instance_set : public hittable
+{
+public:
+	instance_set() {}
+	instance_set(std::vector<shared_ptr<hittable>> _objects, std::vector<placement> _placements, double time0, double time1,
+		const bvh_build_options& options = bvh_build_options(), bvh_stats* stats = nullptr);
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+	size_t memory_bytes() const { return placements.capacity() * sizeof(placement) + nodes.capacity() * sizeof(linear_bvh_node); }
+
+public:
+	std::vector<shared_ptr<hittable>> objects;
+	std::vector<placement> placements; //in the order of the BVH leaves
+	linear_bvh_node_array nodes;
+	aabb box;
+};
+
+instance_set::instance_set(std::vector<shared_ptr<hittable>> _objects, std::vector<placement> _placements, double time0, double time1,
+	const bvh_build_options& options, bvh_stats* stats)
+	: objects(std::move(_objects)), placements(std::move(_placements))
+{
+	if (placements.empty()) return;
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	bvh_build_options leaf_options = options;
+	if (leaf_options.max_leaf_size > UINT16_MAX) leaf_options.max_leaf_size = UINT16_MAX;
+
+	std::vector<aabb> object_boxes(objects.size());
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		if (!objects[i]->bounding_box(time0, time1, object_boxes[i])) std::cerr << "No bounding box in instance_set constructor.\n";
+	}
+
+	std::vector<bvh_primitive> prims(placements.size());
+	if (stats) stats->allocate(prims.capacity() * sizeof(bvh_primitive));
+	for (size_t i = 0; i < placements.size(); i++)
+	{
+		auto& prim = prims[i];
+		prim.box = placements[i].to_world.box(object_boxes[placements[i].object]).conservative();
+		prim.centroid = prim.box.centroid();
+		prim.index = static_cast<uint32_t>(i);
+	}
+
+	nodes.reserve(2 * prims.size() - 1);
+	if (stats) stats->allocate(nodes.capacity() * sizeof(linear_bvh_node));
+	linear_bvh::build(prims, 0, prims.size(), leaf_options, stats, 0, bvh_parallel_depth(leaf_options), nodes);
+
+	//Leaves address the placements in the order the build left the references in
+	std::vector<placement> ordered(placements.size());
+	for (size_t i = 0; i < prims.size(); i++) ordered[i] = placements[prims[i].index];
+	placements.swap(ordered);
+
+	box = aabb(
+		point3(nodes[0].bounds[0][0], nodes[0].bounds[0][1], nodes[0].bounds[0][2]),
+		point3(nodes[0].bounds[1][0], nodes[0].bounds[1][1], nodes[0].bounds[1][2]));
+
+	if (stats)
+	{
+		stats->allocate(placements.capacity() * sizeof(placement));
+		stats->release(prims.capacity() * sizeof(bvh_primitive));
+		stats->finish(box);
+		stats->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	}
+}
+
+bool instance_set::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	const placement* closest_placement = nullptr;
+
+	traverse_linear_bvh(nodes.data(), nodes.size(), r, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest)
+	{
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			const placement& place = placements[i];
+			if (objects[place.object]->intersect(place.object_ray(r), t_min, closest, rec))
+			{
+				closest = rec.t;
+				closest_placement = &place;
+			}
+		}
+		return false;
+	});
+
+	if (!closest_placement) return false;
+
+	//Only the closest hit is finalized and taken back to world space
+	finalize_hit(closest_placement->object_ray(r), rec);
+	closest_placement->world_hit(rec);
+	return true;
+}
+
+bool instance_set::occluded(const ray& r, double t_min, double t_max) const
+{
+	bool hit_anything = false;
+
+	traverse_linear_bvh(nodes.data(), nodes.size(), r, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest)
+	{
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			const placement& place = placements[i];
+			if (objects[place.object]->occluded(place.object_ray(r), t_min, closest)) return hit_anything = true;
+		}
+		return false;
+	});
+
+	return hit_anything;
+}
+
+bool instance_set::bounding_box(double time0, double time1, aabb& output_box) const
+{
+	output_box = box;
+	return true;
+}
+
+#endif
\ No newline at end of file
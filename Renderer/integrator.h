@@ -0,0 +1,144 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "collection.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+
+struct path_settings
+{
+	int max_depth = 32; //segments per path, whatever they scatter off
+	int max_diffuse_depth = 32;
+	int max_specular_depth = 32;
+	int max_transmission_depth = 32;
+	int rr_start_depth = 3; //bounces before russian roulette may end a path
+	double rr_min_survival = .05; //floor on the survival probability, keeps the reweighting bounded
+	bool sample_lights = true; //next-event estimation at surfaces whose material supports it
+};
+
+//Multiple importance sampling weight of the strategy that drew a sample with density pdf_a
+inline double power_heuristic(double pdf_a, double pdf_b)
+{
+	return pdf_a * pdf_a / (pdf_a * pdf_a + pdf_b * pdf_b);
+}
+
+//Next-event estimation: one shadow ray towards a point picked on the light list.
+//The nearest emitter along it contributes if nothing in the world is in front of it, weighted against the chance
+//scatter() had of finding it. Only the small light list is searched for a closest hit, the world gets an any-hit query
+color sample_direct_light(const ray& r_in, const hit_record& rec, const hittable& world, const hittable_list& lights)
+{
+	vec3 direction = lights.random(rec.p);
+	double light_pdf = lights.pdf_value(rec.p, direction);
+	if (light_pdf <= 0.0) return color(0.0);
+
+	color f = rec.mat_ptr->scattering_value(r_in, rec, direction);
+	if (f == color(0.0)) return color(0.0);
+
+	hit_record light_rec;
+	ray shadow(offset_ray_origin(rec, direction), direction, r_in.time());
+	if (!lights.hit(shadow, 0.0, infinity, light_rec)) return color(0.0);
+
+	//Stopped a few ulps short, so the light's own surface in the world does not count as in its way
+	const double unoccluded_t = light_rec.t * (1 - 64 * std::numeric_limits<real>::epsilon());
+	if (world.occluded(shadow, 0.0, unoccluded_t)) return color(0.0);
+
+	color emitted = light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p);
+	double scatter_pdf = rec.mat_ptr->scattering_pdf(r_in, rec, direction);
+	return f * emitted * (power_heuristic(light_pdf, scatter_pdf) / light_pdf);
+}
+
+//Where a path is between segments: the ray it continues along and what it has gathered so far
+struct path_state
+{
+	path_state() {}
+	path_state(const ray& r) : current(r) {}
+
+	ray current;
+	color radiance = color(0.0);
+	color throughput = color(1.0);
+	int depth = 0;
+	int bounces[3] = { 0, 0, 0 }; //indexed by bounce_type
+	double scatter_pdf = 0.0; //density the last bounce was drawn with, 0 if light sampling could not have found it too
+};
+
+//One segment of a path: adds what path.current reached (the background if hit is false, otherwise rec's emission and
+//the light sampled from it) and scatters off it. Returns false once the path has ended; otherwise path.current is the
+//next segment's ray. Emitters in lights are also sampled directly; scattered rays that reach them get the matching MIS weight.
+//Emitters light sampling cannot reach (inside meshes, instances or transforms that do not gather lights) keep weight 1,
+//even where a listed light behind them gives lights.pdf_value() a density in that direction
+bool path_segment(path_state& path, bool hit, const hit_record& rec, const color& background, const hittable& world, const hittable_list& lights, const path_settings& settings)
+{
+	if (path.depth >= settings.max_depth) return false;
+
+	if (!hit)
+	{
+		path.radiance += path.throughput * background;
+		return false;
+	}
+
+	const ray& current = path.current;
+	if (rec.mat_ptr->is_emitter())
+	{
+		color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+		if (path.scatter_pdf > 0.0 && rec.sampled_light) emitted *= power_heuristic(path.scatter_pdf, lights.pdf_value(current.origin(), current.direction()));
+		path.radiance += path.throughput * emitted;
+	}
+
+	ray scattered;
+	color attenuation;
+	if (!rec.mat_ptr->scatter(current, rec, attenuation, scattered)) return false;
+
+	const int max_bounces[3] = { settings.max_diffuse_depth, settings.max_specular_depth, settings.max_transmission_depth };
+	int type = static_cast<int>(rec.mat_ptr->bounce(rec, scattered));
+	if (++path.bounces[type] > max_bounces[type]) return false;
+
+	//Only where the scattered segment gets traced too, so both strategies cover the same paths
+	path.scatter_pdf = 0.0;
+	if (settings.sample_lights && !lights.objects.empty() && path.depth + 1 < settings.max_depth && rec.mat_ptr->samples_lights())
+	{
+		path.radiance += path.throughput * sample_direct_light(current, rec, world, lights);
+		path.scatter_pdf = rec.mat_ptr->scattering_pdf(current, rec, scattered.direction());
+	}
+
+	path.throughput = path.throughput * attenuation;
+
+	//Russian roulette: dim paths survive with a probability proportional to their throughput and
+	//are reweighted by its inverse, so the expected value is unchanged
+	if (path.depth + 1 >= settings.rr_start_depth)
+	{
+		double survival = fmax(path.throughput.x(), fmax(path.throughput.y(), path.throughput.z()));
+		survival = clamp(survival, settings.rr_min_survival, 1.0);
+		if (random_double() >= survival) return false;
+		path.throughput /= survival;
+	}
+
+	path.current = scattered;
+	return ++path.depth < settings.max_depth;
+}
+
+//Iterative path tracer: carries the path's throughput instead of multiplying colours back up a call stack.
+//This overload continues a path whose first intersection is already known (first_hit is false if r escaped),
+//so camera rays can be intersected as packets
+color trace_path(const ray& r, bool first_hit, const hit_record& first_rec, const color& background, const hittable& world, const hittable_list& lights, const path_settings& settings)
+{
+	path_state path(r);
+	hit_record rec = first_rec;
+	bool hit = first_hit;
+
+	while (path_segment(path, hit, rec, background, world, lights, settings))
+	{
+		hit = world.hit(path.current, 0.0, infinity, rec); //scatter() offsets origins off the surface
+	}
+
+	return path.radiance;
+}
+
+color trace_path(const ray& r, const color& background, const hittable& world, const hittable_list& lights, const path_settings& settings)
+{
+	hit_record rec;
+	bool hit = world.hit(r, 0.0, infinity, rec);
+	return trace_path(r, hit, rec, background, world, lights, settings);
+}
+
+#endif
\ No newline at end of file
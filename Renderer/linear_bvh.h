@@ -0,0 +1,289 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include <cassert>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "collection.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+
+//Flattened bounding volume hierarchy: nodes live in one array in depth-first order
+
+struct alignas(32) linear_bvh_node
+{
+	float bounds[2][3]; //min and max corners, rounded outwards
+	uint32_t offset; //leaf: first object in the ordered array; interior: index of the second child (the first one follows this node)
+	uint16_t object_count; //0 for interior nodes
+	uint8_t axis; //split axis of interior nodes
+	uint8_t pad;
+};
+
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should fill half a cache line");
+
+typedef std::vector<linear_bvh_node, aligned_allocator<linear_bvh_node>> linear_bvh_node_array;
+
+inline float round_down(double x)
+{
+	float f = static_cast<float>(x);
+	return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float round_up(double x)
+{
+	float f = static_cast<float>(x);
+	return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+class linear_bvh : public hittable
+{
+public:
+	linear_bvh() {}
+	linear_bvh(const hittable_list& list, double time0, double time1, const bvh_build_options& options = bvh_build_options(), bvh_stats* stats = nullptr);
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual void gather_lights(hittable_list& lights) const override;
+
+	//Also builds the per-mesh trees of triangle_mesh, whose primitives are triangles rather than objects
+	static uint32_t build(std::vector<bvh_primitive>& prims, size_t start, size_t end, const bvh_build_options& options, bvh_stats* stats,
+		int depth, int parallel_depth, linear_bvh_node_array& out);
+
+public:
+	linear_bvh_node_array nodes;
+	std::vector<shared_ptr<hittable>> objects; //reordered so every leaf covers a contiguous range
+	aabb box;
+};
+
+linear_bvh::linear_bvh(const hittable_list& list, double time0, double time1, const bvh_build_options& options, bvh_stats* stats)
+{
+	if (list.objects.empty()) return;
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	bvh_build_options leaf_options = options;
+	if (leaf_options.max_leaf_size > UINT16_MAX) leaf_options.max_leaf_size = UINT16_MAX; //object_count is 16-bit
+
+	auto prims = make_bvh_primitives(list.objects, 0, list.objects.size(), time0, time1, stats);
+	nodes.reserve(2 * prims.size() - 1);
+	if (stats) stats->allocate(nodes.capacity() * sizeof(linear_bvh_node));
+
+	build(prims, 0, prims.size(), leaf_options, stats, 0, bvh_parallel_depth(leaf_options), nodes);
+
+	//Leaves address the objects in the order the build left the references in
+	objects.reserve(prims.size());
+	for (const auto& prim : prims) objects.push_back(list.objects[prim.index]);
+
+	box = aabb(
+		point3(nodes[0].bounds[0][0], nodes[0].bounds[0][1], nodes[0].bounds[0][2]),
+		point3(nodes[0].bounds[1][0], nodes[0].bounds[1][1], nodes[0].bounds[1][2]));
+
+	if (stats)
+	{
+		stats->allocate(objects.capacity() * sizeof(shared_ptr<hittable>));
+		stats->release(prims.capacity() * sizeof(bvh_primitive));
+		stats->finish(box);
+		stats->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	}
+}
+
+//Appends the subtree for prims[start, end) to out in depth-first order and returns its root's index
+uint32_t linear_bvh::build(std::vector<bvh_primitive>& prims, size_t start, size_t end, const bvh_build_options& options, bvh_stats* stats,
+	int depth, int parallel_depth, linear_bvh_node_array& out)
+{
+	assert(depth <= bvh_max_depth); //bvh_split halves deep ranges, so this only fails if that is broken
+
+	uint32_t index = static_cast<uint32_t>(out.size());
+	out.emplace_back();
+
+	aabb node_box = bvh_bounds(prims, start, end);
+
+	size_t mid;
+	int axis;
+	if (!bvh_split(prims, start, end, depth, options, mid, axis))
+	{
+		out[index].offset = static_cast<uint32_t>(start);
+		out[index].object_count = static_cast<uint16_t>(end - start);
+		if (stats) stats->add_leaf(node_box, depth, end - start, options);
+	}
+	else if (depth < parallel_depth && end - start >= bvh_parallel_min_objects)
+	{
+		//Build both subtrees into their own arrays, then splice them in the same order the serial build would write them
+		linear_bvh_node_array left_nodes, right_nodes;
+		bvh_stats left_stats;
+		bvh_stats* left_stats_ptr = stats ? &left_stats : nullptr;
+		std::thread left_thread([&]() { build(prims, start, mid, options, left_stats_ptr, depth + 1, parallel_depth, left_nodes); });
+		build(prims, mid, end, options, stats, depth + 1, parallel_depth, right_nodes);
+		left_thread.join();
+
+		size_t subtree_bytes = (left_nodes.capacity() + right_nodes.capacity()) * sizeof(linear_bvh_node);
+		if (stats)
+		{
+			stats->merge(left_stats);
+			stats->allocate(subtree_bytes);
+		}
+
+		for (auto* subtree : { &left_nodes, &right_nodes })
+		{
+			uint32_t base = static_cast<uint32_t>(out.size());
+			if (subtree == &right_nodes) out[index].offset = base;
+
+			for (auto node : *subtree)
+			{
+				if (node.object_count == 0) node.offset += base; //child indices were relative to the subtree's array
+				out.push_back(node);
+			}
+		}
+
+		if (stats) stats->release(subtree_bytes);
+
+		out[index].object_count = 0;
+		out[index].axis = static_cast<uint8_t>(axis);
+		if (stats) stats->add_interior(node_box, depth, options);
+	}
+	else
+	{
+		build(prims, start, mid, options, stats, depth + 1, parallel_depth, out);
+		uint32_t second_child = build(prims, mid, end, options, stats, depth + 1, parallel_depth, out); //out may reallocate in here
+		out[index].offset = second_child;
+		out[index].object_count = 0;
+		out[index].axis = static_cast<uint8_t>(axis);
+		if (stats) stats->add_interior(node_box, depth, options);
+	}
+
+	for (int a = 0; a < 3; a++)
+	{
+		out[index].bounds[0][a] = round_down(node_box.miny()[a]);
+		out[index].bounds[1][a] = round_up(node_box.maxy()[a]);
+	}
+
+	return index;
+}
+
+//Visits the leaves a ray reaches, nearest side first. leaf_hit(first, count, t_max) tests the leaf's primitives and
+//lowers t_max to its closest hit, so the remaining nodes are culled against it; it returns true to end the
+//traversal there, as an any-hit query does on its first hit
+template <typename LeafHit>
+void traverse_linear_bvh(const linear_bvh_node* nodes, size_t node_count, const ray& r, double t_min, double t_max, LeafHit leaf_hit)
+{
+	if (node_count == 0) return;
+
+	const point3& origin = r.orig;
+	const vec3& inv_dir = r.inv_dir;
+	const int* dir_is_neg = r.sign;
+
+	uint32_t to_visit[bvh_max_depth]; //one entry per level at most
+	int to_visit_count = 0;
+	uint32_t current = 0;
+
+	while (true)
+	{
+		const linear_bvh_node& node = nodes[current];
+		count_node_fetch(&node);
+
+		//Slab test against the current closest hit, so nodes behind it are culled
+		bool node_hit = true;
+		double t0 = t_min, t1 = t_max;
+		for (int a = 0; a < 3 && node_hit; a++)
+		{
+			double near_t = (node.bounds[dir_is_neg[a]][a] - origin[a]) * inv_dir[a];
+			double far_t = (node.bounds[1 - dir_is_neg[a]][a] - origin[a]) * inv_dir[a] * slab_far_slack;
+			t0 = near_t > t0 ? near_t : t0;
+			t1 = far_t < t1 ? far_t : t1;
+			node_hit = t1 > t0;
+		}
+
+		if (node_hit && node.object_count > 0)
+		{
+			count_primitive_tests(node.object_count);
+			if (leaf_hit(node.offset, node.object_count, t_max)) return;
+		}
+		else if (node_hit)
+		{
+			//Visit the child on the ray's near side first
+			if (dir_is_neg[node.axis])
+			{
+				to_visit[to_visit_count++] = current + 1;
+				current = node.offset;
+			}
+			else
+			{
+				to_visit[to_visit_count++] = node.offset;
+				current = current + 1;
+			}
+			continue;
+		}
+
+		if (to_visit_count == 0) break;
+		current = to_visit[--to_visit_count];
+	}
+}
+
+bool linear_bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
+	return true;
+}
+
+bool linear_bvh::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	counted_query query(1);
+	bool hit_anything = false;
+
+	traverse_linear_bvh(nodes.data(), nodes.size(), r, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest)
+	{
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			if (objects[i]->intersect(r, t_min, closest, rec))
+			{
+				hit_anything = true;
+				closest = rec.t;
+				if (objects[i]->emissive()) rec.sampled_light = true; //gather_lights() lists it
+			}
+		}
+		return false;
+	});
+
+	return hit_anything;
+}
+
+bool linear_bvh::occluded(const ray& r, double t_min, double t_max) const
+{
+	counted_query query(1);
+	bool hit_anything = false;
+
+	traverse_linear_bvh(nodes.data(), nodes.size(), r, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest)
+	{
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			if (objects[i]->occluded(r, t_min, closest)) return hit_anything = true;
+		}
+		return false;
+	});
+
+	return hit_anything;
+}
+
+bool linear_bvh::bounding_box(double time0, double time1, aabb& output_box) const
+{
+	output_box = box;
+	return true;
+}
+
+void linear_bvh::gather_lights(hittable_list& lights) const
+{
+	for (const auto& object : objects)
+	{
+		if (object->emissive()) lights.add(object);
+		else object->gather_lights(lights);
+	}
+}
+
+#endif
\ No newline at end of file
@@ -2,7 +2,12 @@
 
 #include "camera.h"
 #include "color.h"
+#include "integrator.h"
+#include "wavefront.h"
+#include "ray_sort.h"
 #include "bvh.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
 
 #include "hittable_list.h"
 #include "material.h"
@@ -12,12 +17,19 @@
 #include "aarect.h"
 #include "box.h"
 #include "constant_medium.h"
+#include "triangle_mesh.h"
+#include "obj_loader.h"
+#include "mesh_cache.h"
+#include "instance.h"
+#include "scene_prep.h"
 
 #include <iostream>
 #include <sstream>
 #include <shlobj.h>
 #include <ctime>
 #include "bitmap.h"
+#include "scheduler.h"
+#include "sampler.h"
 using std::string;
 
 #include <thread>
@@ -52,22 +64,6 @@ void report_status(atomic<bool>* rep, steady_clock::time_point start, atomic<int
 	return;
 }
 
-color ray_color(const ray& r, const color& background, const hittable& world, int depth)
-{
-	if (depth <= 0) return color(0.0);
-
-	hit_record rec;
-	if (!world.hit(r, .001, infinity, rec)) return background;
-
-	ray scattered;
-	color attenuation;
-	color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-
-	if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered)) return emitted;
-
-	return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
-}
-
 hittable_list random_scene() {
 	hittable_list world;
 
@@ -247,7 +243,7 @@ hittable_list final_scene() {
 
 	hittable_list objects;
 
-	objects.add(make_shared<bvh_node>(boxes1, 0, 1));
+	objects.add(make_shared<bvh4>(boxes1, 0, 1));
 
 	auto light = make_shared<diffuse_light>(color(7, 7, 7));
 	objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
@@ -282,7 +278,7 @@ hittable_list final_scene() {
 
 	objects.add(make_shared<translate>(
 		make_shared<rotate_y>(
-			make_shared<bvh_node>(boxes2, 0.0, 1.0), 15),
+			make_shared<bvh4>(boxes2, 0.0, 1.0), 15),
 		vec3(-100, 270, 395)
 		)
 	);
@@ -305,40 +301,533 @@ hittable_list hdr_scene()
 	return world;
 }
 
+//The mesh stands on a floor under an area light, both sized to it; mesh_bounds is returned to frame the camera
+hittable_list mesh_scene(const char* filename, aabb& mesh_bounds)
+{
+	hittable_list world;
+
+	auto white = make_shared<lambertian>(color(.73, .73, .73));
+	shared_ptr<hittable> mesh = load_obj_cached(filename, make_shared<lambertian>(color(.8, .6, .3)));
+	if (!mesh) mesh = make_shared<sphere>(point3(0.0, 1.0, 0.0), 1.0, white); //stand-in, the error has been reported
+	mesh->bounding_box(0.0, 1.0, mesh_bounds);
+
+	point3 center = mesh_bounds.centroid();
+	vec3 extent = mesh_bounds.maxy() - mesh_bounds.miny();
+	double size = fmax(extent.x(), fmax(extent.y(), extent.z()));
+	double floor = mesh_bounds.miny().y();
+
+	world.add(mesh);
+	world.add(make_shared<xz_rect>(center.x() - 10 * size, center.x() + 10 * size, center.z() - 10 * size, center.z() + 10 * size, floor, white));
+	world.add(make_shared<xz_rect>(center.x() - size, center.x() + size, center.z() - size, center.z() + size, floor + 3 * size, make_shared<diffuse_light>(color(1.0, .95, .9), 4.0)));
+
+	return world;
+}
+
+//final_scene()'s cluster of 1000 spheres, built once and placed clusters_per_side^2 times with its own turn and size
+hittable_list instanced_clusters(int clusters_per_side = 32)
+{
+	hittable_list cluster;
+	auto white = make_shared<lambertian>(color(.73, .73, .73));
+	for (int j = 0; j < 1000; j++) {
+		cluster.add(make_shared<sphere>(point3::random(0, 165), 10, white));
+	}
+
+	std::vector<shared_ptr<hittable>> shared_objects = { make_shared<bvh4>(cluster, 0.0, 1.0) };
+	std::vector<placement> placements;
+	const double spacing = 250.0;
+	for (int i = 0; i < clusters_per_side; i++) {
+		for (int j = 0; j < clusters_per_side; j++) {
+			double scale = random_double(.5, 1.0);
+			affine3 transform = affine3::translation(vec3((i - clusters_per_side / 2) * spacing, 0.0, (j - clusters_per_side / 2) * spacing))
+				* affine3::rotation(vec3(0.0, 1.0, 0.0), random_double(0.0, 360.0))
+				* affine3::scaling(vec3(scale))
+				* affine3::translation(vec3(-82.5, 0.0, -82.5)); //turns around the cluster's footprint center
+			placements.push_back(placement(0, transform));
+		}
+	}
+
+	hittable_list world;
+	world.add(make_shared<instance_set>(shared_objects, placements, 0.0, 1.0));
+
+	double extent = clusters_per_side * spacing;
+	world.add(make_shared<xz_rect>(-extent, extent, -extent, extent, -10.0, make_shared<lambertian>(color(.48, .83, .53))));
+
+	return world;
+}
+
+struct render_settings
+{
+	int image_width;
+	int image_height;
+	int samples_per_pixel; //the most any pixel gets when sampling adaptively
+	path_settings path;
+	adaptive_settings adaptive;
+	int tile_size;
+	int threads;
+	bool packets; //intersect each pixel's camera rays four at a time
+	bool wavefront; //trace a tile's samples together, stage by stage, instead of one path after another
+	bool sort_rays; //in wavefront rounds, bin the scattered rays by origin and direction before tracing them
+};
+
+//Owns the scene for the length of a render; workers only ever see it through const references
+class render_session
+{
+public:
+	render_session(const render_settings& _settings, const camera& _cam, const color& _background, shared_ptr<const bvh4> _world, shared_ptr<const hittable_list> _lights)
+		: settings(_settings), cam(_cam), background(_background), world(std::move(_world)), lights(std::move(_lights)) {}
+
+	void render(BYTE* image, vector<int>& sample_counts, steady_clock::time_point start) const;
+
+public:
+	const render_settings settings;
+	const camera cam;
+	const color background;
+	const shared_ptr<const bvh4> world; //built once for the render, camera rays traverse it as packets
+	const shared_ptr<const hittable_list> lights; //emitters sampled directly, they are part of world as well
+};
+
 class task
 {
 public:
-	void operator() (int _id, int num_of_threads, atomic<int>* progress, int width, int height, int samples_per_pixel, camera cam, color background, const hittable& world, int max_depth)
+	task(const render_session& _session, tile_scheduler& _scheduler, atomic<int>& _progress, BYTE* _image, int* _sample_counts, traversal_stats* _stats)
+		: session(_session), scheduler(_scheduler), progress(_progress), image(_image), sample_counts(_sample_counts), stats(_stats) {}
+
+	void operator() (int id) const
 	{
-		id = _id;
-		buff = new BYTE[3 * ceil(width * height / (float)num_of_threads)];
+		const auto& settings = session.settings;
+		const bvh4& world = *session.world;
+		const hittable_list& lights = *session.lights;
+
+		wavefront_integrator wavefront(world, lights, session.background, settings.path, settings.sort_rays);
+		wavefront_batch wavefront_paths;
 
-		for (int i = id, pointer = 0; i < width * height; i += num_of_threads)
+		tile t;
+		while (scheduler.next(id, t))
 		{
-			int y = floor(i / (double)width);
-			int x = i - y * width;
+			if (settings.wavefront)
+			{
+				wavefront_tile(t, wavefront, wavefront_paths);
+				progress.fetch_add((t.x1 - t.x0) * (t.y1 - t.y0));
+				continue;
+			}
 
-			color pixel_color(0.0, 0.0, 0.0);
-			for (int s = 0; s < samples_per_pixel; ++s)
+			for (int y = t.y0; y < t.y1; y++)
 			{
-				auto u = double(x + random_double()) / (width - 1);
-				auto v = double(y + random_double()) / (height - 1);
-				ray r = cam.get_ray(u, v);
-				pixel_color += ray_color(r, background, world, max_depth);
+				for (int x = t.x0; x < t.x1; x++)
+				{
+					int i = y * settings.image_width + x;
+
+					seed_random(i);
+					pixel_estimator pixel;
+					while (pixel.n < settings.samples_per_pixel)
+					{
+						//Sample in batches, checking the pixel's variance between them
+						int batch = settings.samples_per_pixel - pixel.n;
+						if (settings.adaptive.enabled)
+						{
+							int step = pixel.n < settings.adaptive.min_samples ? settings.adaptive.min_samples - pixel.n : settings.adaptive.batch_size;
+							batch = (std::min)(batch, step);
+						}
+
+						int packet_size = settings.packets ? 4 : 1;
+						for (int s = 0; s < batch; s += packet_size)
+						{
+							int count = (std::min)(packet_size, batch - s);
+							ray rays[4];
+							hit_record recs[4];
+							bool hits[4];
+
+							for (int k = 0; k < count; k++)
+							{
+								auto u = double(x + random_double()) / (settings.image_width - 1);
+								auto v = double(y + random_double()) / (settings.image_height - 1);
+								rays[k] = session.cam.get_ray(u, v);
+							}
+
+							if (settings.packets) world.hit4(rays, count, 0.0, infinity, recs, hits);
+							else hits[0] = world.hit(rays[0], 0.0, infinity, recs[0]);
+
+							for (int k = 0; k < count; k++) pixel.add(trace_path(rays[k], hits[k], recs[k], session.background, world, lights, settings.path));
+						}
+
+						if (settings.adaptive.enabled && pixel.converged(settings.adaptive)) break;
+					}
+
+					write_color(image, i * 3, pixel.sum, pixel.n); //writing straight into the bitmap buffer
+					sample_counts[i] = pixel.n;
+				}
 			}
 
-			write_color(buff, pointer * 3, pixel_color, samples_per_pixel); //writing into bitmap buffer
+			progress.fetch_add((t.x1 - t.x0) * (t.y1 - t.y0));
+		}
+
+		stats[id] = thread_traversal_stats(); //the thread's counters start at zero with it
+	}
+
+private:
+	//Every round queues the next batch of samples of each pixel still sampling, as paths with their own seeds,
+	//traces them all and hands the results to the pixels in sample order
+	void wavefront_tile(const tile& t, wavefront_integrator& wavefront, wavefront_batch& batch) const
+	{
+		const auto& settings = session.settings;
+		int width = t.x1 - t.x0;
+		int pixel_count = width * (t.y1 - t.y0);
+
+		vector<pixel_estimator> pixels(pixel_count);
+		vector<int> sampling(pixel_count);
+		for (int p = 0; p < pixel_count; p++) sampling[p] = p;
+
+		pcg32x4& thread_generator = thread_rng();
+		while (!sampling.empty())
+		{
+			batch.count = 0;
+			batch.pixels.clear();
+			for (int p : sampling)
+			{
+				int x = t.x0 + p % width;
+				int y = t.y0 + p / width;
+				const pixel_estimator& pixel = pixels[p];
+
+				int count = settings.samples_per_pixel - pixel.n;
+				if (settings.adaptive.enabled)
+				{
+					int step = pixel.n < settings.adaptive.min_samples ? settings.adaptive.min_samples - pixel.n : settings.adaptive.batch_size;
+					count = (std::min)(count, step);
+				}
+
+				if (batch.paths.size() < batch.count + count) batch.paths.resize(batch.count + count);
+				for (int s = 0; s < count; s++)
+				{
+					wavefront_path& path = batch.paths[batch.count];
+					path.rng.seed((uint64_t(y * settings.image_width + x) << 32) | uint64_t(pixel.n + s)); //one stream per pixel sample
+					path.sample = static_cast<uint32_t>(batch.count++);
 
-			pointer++;
-			progress->fetch_add(1);
+					std::swap(thread_generator, path.rng);
+					auto u = double(x + random_double()) / (settings.image_width - 1);
+					auto v = double(y + random_double()) / (settings.image_height - 1);
+					path.state = path_state(session.cam.get_ray(u, v));
+					std::swap(thread_generator, path.rng);
+
+					batch.pixels.push_back(p);
+				}
+			}
+
+			batch.radiance.resize(batch.count);
+			wavefront.trace(batch.paths.data(), batch.count, batch.radiance.data());
+			for (size_t k = 0; k < batch.count; k++) pixels[batch.pixels[k]].add(batch.radiance[k]);
+
+			//Pixels drop out of the rounds once they have all their samples or have converged
+			size_t still_sampling = 0;
+			for (int p : sampling)
+			{
+				bool done = pixels[p].n >= settings.samples_per_pixel || (settings.adaptive.enabled && pixels[p].converged(settings.adaptive));
+				if (!done) sampling[still_sampling++] = p;
+			}
+			sampling.resize(still_sampling);
+		}
+
+		for (int p = 0; p < pixel_count; p++)
+		{
+			int i = (t.y0 + p / width) * settings.image_width + t.x0 + p % width;
+			write_color(image, i * 3, pixels[p].sum, pixels[p].n);
+			sample_counts[i] = pixels[p].n;
 		}
 	}
 
-public:
-	int id;
-	BYTE* buff;
+private:
+	const render_session& session;
+	tile_scheduler& scheduler;
+	atomic<int>& progress;
+	BYTE* image;
+	int* sample_counts; //each pixel is written by the one thread rendering its tile
+	traversal_stats* stats; //one slot per thread
 };
 
+void render_session::render(BYTE* image, vector<int>& sample_counts, steady_clock::time_point start) const
+{
+	sample_counts.assign(settings.image_width * settings.image_height, 0);
+
+	tile_scheduler scheduler(settings.image_width, settings.image_height, settings.tile_size, settings.threads);
+	atomic<bool> report(true);
+	atomic<int> progress(0);
+
+	//Tasks only hold references, so starting a worker copies neither the scene nor the camera
+	thread progress_thread(report_status, &report, start, &progress, settings.image_width * settings.image_height);
+	vector<thread> threads;
+	vector<traversal_stats> thread_stats(settings.threads);
+	for (int i = 0; i < settings.threads; i++)
+	{
+		threads.emplace_back(task(*this, scheduler, progress, image, sample_counts.data(), thread_stats.data()), i);
+	}
+
+	//Wait for threads to finish
+	for (thread& t : threads)
+	{
+		t.join();
+	}
+	report.store(false);
+	progress_thread.join();
+	write_status(start, 1, 1);
+
+	auto seconds = duration_cast<microseconds>(high_resolution_clock::now() - start).count() / 1000000.0;
+	double paths = 0.0;
+	for (int n : sample_counts) paths += n;
+	double max_paths = double(settings.image_width) * settings.image_height * settings.samples_per_pixel;
+	std::cerr << "\nThroughput: " << paths / seconds / 1000000.0 << " Mpaths/s";
+	std::cerr << "\nSamples: " << paths / (settings.image_width * settings.image_height) << " per pixel on average, "
+		<< 100.0 * (1.0 - paths / max_paths) << "% of " << settings.samples_per_pixel << " spp saved";
+
+	traversal_stats traversal;
+	for (const auto& s : thread_stats) traversal.merge(s);
+	std::cerr << '\n';
+	traversal.report(std::cerr);
+}
+
+//Camera ray intersection throughput of the scalar and the packet traversal over the same rays
+void benchmark_primary_rays(const render_session& session, int rays_per_pixel)
+{
+	const auto& settings = session.settings;
+	const bvh4& world = *session.world;
+
+	vector<ray> rays;
+	rays.reserve(size_t(settings.image_width) * settings.image_height * rays_per_pixel);
+	seed_random(0);
+	for (int y = 0; y < settings.image_height; y++)
+	{
+		for (int x = 0; x < settings.image_width; x++)
+		{
+			for (int s = 0; s < rays_per_pixel; s++)
+			{
+				auto u = double(x + random_double()) / (settings.image_width - 1);
+				auto v = double(y + random_double()) / (settings.image_height - 1);
+				rays.push_back(session.cam.get_ray(u, v));
+			}
+		}
+	}
+
+	hit_record recs[4];
+	bool hits[4];
+	size_t scalar_hits = 0, packet_hits = 0;
+
+	auto start = steady_clock::now();
+	for (const auto& r : rays) scalar_hits += world.hit(r, 0.0, infinity, recs[0]);
+	double scalar_seconds = duration<double>(steady_clock::now() - start).count();
+
+	start = steady_clock::now();
+	for (size_t i = 0; i < rays.size(); i += 4)
+	{
+		int count = static_cast<int>((std::min)(rays.size() - i, size_t(4)));
+		world.hit4(&rays[i], count, 0.0, infinity, recs, hits);
+		for (int k = 0; k < count; k++) packet_hits += hits[k];
+	}
+	double packet_seconds = duration<double>(steady_clock::now() - start).count();
+
+	std::cerr << "Primary rays: scalar " << rays.size() / scalar_seconds / 1000000.0 << " Mrays/s, "
+		<< "packets " << rays.size() / packet_seconds / 1000000.0 << " Mrays/s (" << scalar_hits << " / " << packet_hits << " hits)\n";
+}
+
+//Segments between random points in the scene's bounds, as visibility tests: closest-hit against any-hit queries
+void benchmark_shadow_rays(const render_session& session, int ray_count)
+{
+	const bvh4& world = *session.world;
+	aabb bounds;
+	if (!world.bounding_box(0.0, 1.0, bounds)) return;
+
+	seed_random(0);
+	vector<ray> rays;
+	rays.reserve(ray_count);
+	for (int i = 0; i < ray_count; i++)
+	{
+		point3 from, to;
+		for (int a = 0; a < 3; a++)
+		{
+			from[a] = random_double(bounds.miny()[a], bounds.maxy()[a]);
+			to[a] = random_double(bounds.miny()[a], bounds.maxy()[a]);
+		}
+		rays.push_back(ray(from, to - from, random_double()));
+	}
+
+	hit_record rec;
+	size_t closest_hits = 0, any_hits = 0;
+
+	auto start = steady_clock::now();
+	for (const auto& r : rays) closest_hits += world.hit(r, 0.0, 1.0, rec);
+	double closest_seconds = duration<double>(steady_clock::now() - start).count();
+
+	start = steady_clock::now();
+	for (const auto& r : rays) any_hits += world.occluded(r, 0.0, 1.0);
+	double any_seconds = duration<double>(steady_clock::now() - start).count();
+
+	std::cerr << "Shadow rays: hit " << ray_count / closest_seconds / 1000000.0 << " Mrays/s, "
+		<< "occluded " << ray_count / any_seconds / 1000000.0 << " Mrays/s (" << closest_hits << " / " << any_hits << " blocked)\n";
+}
+
+//First bounce rays, in the order their pixels scattered them and binned by ray_sorter, traced as one batch each.
+//Node fetches per ray are only counted with RENDERER_TRAVERSAL_STATS defined
+void benchmark_secondary_rays(const render_session& session, int rays_per_pixel)
+{
+	const auto& settings = session.settings;
+	const bvh4& world = *session.world;
+	ray_sorter sorter;
+	if (!world.bounding_box(0.0, 1.0, sorter.bounds)) return;
+
+	seed_random(0);
+	vector<ray> rays;
+	hit_record rec;
+	for (int y = 0; y < settings.image_height; y++)
+	{
+		for (int x = 0; x < settings.image_width; x++)
+		{
+			for (int s = 0; s < rays_per_pixel; s++)
+			{
+				auto u = double(x + random_double()) / (settings.image_width - 1);
+				auto v = double(y + random_double()) / (settings.image_height - 1);
+				ray r = session.cam.get_ray(u, v);
+
+				color attenuation;
+				ray scattered;
+				if (world.hit(r, 0.0, infinity, rec) && rec.mat_ptr->scatter(r, rec, attenuation, scattered)) rays.push_back(scattered);
+			}
+		}
+	}
+	if (rays.empty()) return;
+
+	//A batch is traced in the order it is stored, so the sorted rays are moved into that order too
+	vector<ray> sorted(rays.size());
+	vector<uint32_t> order(rays.size());
+	for (size_t i = 0; i < order.size(); i++) order[i] = static_cast<uint32_t>(i);
+
+	auto start = steady_clock::now();
+	sorter.sort(order.data(), order.size(), [&](uint32_t i) -> const ray& { return rays[i]; });
+	for (size_t i = 0; i < order.size(); i++) sorted[i] = rays[order[i]];
+	double sort_seconds = duration<double>(steady_clock::now() - start).count();
+
+	//Traces the batch, returns the seconds it took and what the traversal counted
+	auto trace = [&](const vector<ray>& batch, size_t& hits, traversal_stats& counted)
+	{
+		traversal_stats before = thread_traversal_stats();
+		auto trace_start = steady_clock::now();
+		for (const auto& r : batch) hits += world.hit(r, 0.0, infinity, rec);
+		double seconds = duration<double>(steady_clock::now() - trace_start).count();
+
+		const traversal_stats& after = thread_traversal_stats();
+		counted.queries = after.queries - before.queries;
+		counted.node_fetches = after.node_fetches - before.node_fetches;
+		counted.node_misses = after.node_misses - before.node_misses;
+		counted.primitive_tests = after.primitive_tests - before.primitive_tests;
+		return seconds;
+	};
+
+	size_t unsorted_hits = 0, sorted_hits = 0;
+	traversal_stats unsorted_counts, sorted_counts;
+	trace(sorted, sorted_hits, sorted_counts); //warms the caches for both
+	sorted_hits = 0;
+	double unsorted_seconds = trace(rays, unsorted_hits, unsorted_counts);
+	double sorted_seconds = trace(sorted, sorted_hits, sorted_counts);
+
+	std::cerr << "Secondary rays: unsorted " << rays.size() / unsorted_seconds / 1000000.0 << " Mrays/s, "
+		<< "sorted " << rays.size() / sorted_seconds / 1000000.0 << " Mrays/s plus " << rays.size() / sort_seconds / 1000000.0 << " Mrays/s sorting ("
+		<< unsorted_hits << " / " << sorted_hits << " hits)\n";
+	std::cerr << "Unsorted ";
+	unsorted_counts.report(std::cerr);
+	std::cerr << "Sorted ";
+	sorted_counts.report(std::cerr);
+}
+
+//Tests per second of the single-ray intersection routines on random rays, with ray construction timed on its own
+void benchmark_intersections(int ray_count)
+{
+	seed_random(0);
+	vector<point3> origins, targets;
+	for (int i = 0; i < ray_count; i++)
+	{
+		origins.push_back(point3(random_double(-10.0, 10.0), random_double(-10.0, 10.0), -20.0));
+		targets.push_back(point3(random_double(-5.0, 5.0), random_double(-5.0, 5.0), 0.0));
+	}
+
+	auto start = steady_clock::now();
+	vector<ray> rays;
+	rays.reserve(ray_count);
+	for (int i = 0; i < ray_count; i++) rays.push_back(ray(origins[i], targets[i] - origins[i], 0.0));
+	double setup_seconds = duration<double>(steady_clock::now() - start).count();
+
+	vector<aabb> boxes;
+	for (int i = 0; i < 16; i++)
+	{
+		point3 corner(random_double(-5.0, 4.0), random_double(-5.0, 4.0), random_double(-1.0, 1.0));
+		boxes.push_back(aabb(corner, corner + vec3(random_double(.1, 1.0))));
+	}
+	auto lambert = make_shared<lambertian>(color(.5));
+	rect quad(point3(-3.0, 0.0, -3.0), vec3(6.0, 0.0, 0.0), vec3(0.0, 0.0, 6.0), lambert);
+	sphere ball(point3(0.0), 3.0, lambert);
+
+	size_t box_hits = 0, rect_hits = 0, sphere_hits = 0;
+	hit_record rec;
+
+	start = steady_clock::now();
+	for (const auto& r : rays) for (const auto& b : boxes) box_hits += b.hit(r, 0.0, infinity);
+	double box_seconds = duration<double>(steady_clock::now() - start).count();
+
+	start = steady_clock::now();
+	for (const auto& r : rays) rect_hits += quad.hit(r, 0.0, infinity, rec);
+	double rect_seconds = duration<double>(steady_clock::now() - start).count();
+
+	start = steady_clock::now();
+	for (const auto& r : rays) sphere_hits += ball.hit(r, 0.0, infinity, rec);
+	double sphere_seconds = duration<double>(steady_clock::now() - start).count();
+
+	std::cerr << "Ray setup: " << ray_count / setup_seconds / 1000000.0 << " Mrays/s\n"
+		<< "aabb: " << ray_count * boxes.size() / box_seconds / 1000000.0 << " Mtests/s (" << box_hits << " hits)\n"
+		<< "rect: " << ray_count / rect_seconds / 1000000.0 << " Mtests/s (" << rect_hits << " hits)\n"
+		<< "sphere: " << ray_count / sphere_seconds / 1000000.0 << " Mtests/s (" << sphere_hits << " hits)\n";
+}
+
+//Brute force check of the bvh4 traversals on rays aimed within a hair of box edges, where float slab tests round
+//the other way from the double ones and are most likely to miss. Every count should come out 0
+void check_bvh4_edges(int ray_count)
+{
+	seed_random(0);
+	auto lambert = make_shared<lambertian>(color(.5));
+	hittable_list boxes;
+	boxes.add(make_shared<box>(point3(0.0), point3(555.0), lambert));
+	boxes.add(make_shared<box>(point3(600.0, -100.0, 50.0), point3(1155.0, 455.0, 605.0), lambert));
+	boxes.add(make_shared<box>(point3(-700.0, 200.0, -300.0), point3(-145.0, 755.0, 255.0), lambert));
+	bvh4 world(boxes, 0.0, 1.0);
+
+	size_t reference_hits = 0, hit_misses = 0, hit4_misses = 0, occluded_misses = 0, wrong_distances = 0;
+	for (int i = 0; i < ray_count; i++)
+	{
+		const box& target_box = static_cast<const box&>(*boxes.objects[i % boxes.objects.size()]);
+		int along = random_int(0, 2);
+		point3 target;
+		for (int a = 0; a < 3; a++)
+		{
+			if (a == along) target[a] = random_double(target_box.box_min[a], target_box.box_max[a]);
+			else target[a] = (random_double() < .5 ? target_box.box_min[a] : target_box.box_max[a]) + random_double(-2e-4, 2e-4);
+		}
+		point3 origin(random_double(-1000.0, 1000.0), random_double(-1000.0, 1000.0), random_double(-1000.0, 1000.0));
+		ray r(origin, target - origin, 0.0);
+
+		hit_record reference;
+		if (!boxes.hit(r, 0.0, infinity, reference)) continue;
+		reference_hits++;
+
+		hit_record rec;
+		if (!world.hit(r, 0.0, infinity, rec)) hit_misses++;
+		else if (rec.t != reference.t) wrong_distances++;
+		if (!world.occluded(r, 0.0, infinity)) occluded_misses++;
+
+		ray rays[4] = { r, r, r, r };
+		hit_record recs[4];
+		bool hits[4];
+		world.hit4(rays, 4, 0.0, infinity, recs, hits);
+		for (int k = 0; k < 4; k++) hit4_misses += !hits[k];
+	}
+
+	std::cerr << "bvh4 edge rays: " << reference_hits << " hits, misses: hit " << hit_misses << ", hit4 " << hit4_misses
+		<< ", occluded " << occluded_misses << " (" << wrong_distances << " wrong distances)\n";
+}
+
 int main()
 {
 	//Image
@@ -347,15 +836,28 @@ int main()
 	const int image_height = static_cast<int>(image_width / aspect_ratio);
 	const int samples_per_pixel = 2560;
 	const int max_depth = 32;
+	const int tile_size = 16;
+	const bool packets = true;
+	const bool wavefront = false; //shade samples in batches sorted by material (wavefront.h), instead of path by path
+	const bool sort_rays = false; //wavefront only: reorder scattered rays by origin cell and direction octant (ray_sort.h)
+	const bool run_benchmarks = false; //time the intersection routines and scalar against packet camera rays before rendering
+
+	//Path tracing
+	path_settings path;
+	path.max_depth = max_depth;
+	path.max_diffuse_depth = max_depth;
+	path.max_specular_depth = max_depth;
+	path.max_transmission_depth = max_depth;
+
+	//Adaptive sampling
+	adaptive_settings adaptive;
+	adaptive.min_samples = 64;
+	adaptive.threshold = .004;
 
 	//Render Variables
 	const int number_of_threads = thread::hardware_concurrency() <= 0 ? 4 : thread::hardware_concurrency();
-	BYTE* image_buffer = new BYTE[3 * image_width * image_height];
-	vector<thread> threads;
-	vector<task*> tasks;
-
-	atomic<bool> report(true);
-	atomic<int> thread_progress(0);
+	vector<BYTE> image_buffer(3 * image_width * image_height);
+	vector<int> sample_counts;
 
 	//Camera
 	point3 lookfrom;
@@ -424,6 +926,25 @@ int main()
 		vfov = 40.0;
 		dist_to_focus = (lookat - lookfrom).length();
 		break;
+	case 9:
+	{
+		aabb mesh_bounds;
+		world = mesh_scene("bunny.obj", mesh_bounds);
+		background = color(.05);
+		lookat = mesh_bounds.centroid();
+		lookfrom = lookat + (mesh_bounds.maxy() - mesh_bounds.miny()).length() * vec3(.4, .5, 1.5);
+		vfov = 30.0;
+		dist_to_focus = (lookat - lookfrom).length();
+		break;
+	}
+	case 10:
+		world = instanced_clusters();
+		background = color(.70, .80, 1.00);
+		lookfrom = point3(-600, 900, -3000);
+		lookat = point3(0, 0, 0);
+		vfov = 40.0;
+		dist_to_focus = (lookat - lookfrom).length();
+		break;
 	default:
 	case 8:
 		world = hdr_scene();
@@ -461,39 +982,20 @@ int main()
 	//}
 
 	//Starting threads
-	thread progress_thread(report_status, &report, startTime, &thread_progress, image_width * image_height);
-	for (int i = 0; i < number_of_threads; i++)
-	{
-		task* t = new task();
-		threads.push_back(thread(std::ref(*t), i, number_of_threads, &thread_progress, image_width, image_height, samples_per_pixel, cam, background, world, max_depth));
-		tasks.push_back(t);
-	}
-
-	//Wait for threads to finish
-	for (thread& t : threads)
-	{
-		if (t.joinable())
-		{
-			t.join();
-		}
-	}
-	report.store(false);
-	write_status(startTime, 1, 1);
-
-	//Constract final image
-	for (auto t : tasks)
+	render_settings settings = { image_width, image_height, samples_per_pixel, path, adaptive, tile_size, number_of_threads, packets, wavefront, sort_rays };
+	fold_transforms(world);
+	auto lights = make_shared<hittable_list>();
+	world.gather_lights(*lights);
+	render_session session(settings, cam, background, make_shared<bvh4>(world, 0.0, 1.0), lights);
+	if (run_benchmarks)
 	{
-		for (int i = t->id, pointer = 0; i < image_width * image_height; i += number_of_threads)
-		{
-			int y = floor(i / (double)image_width);
-			int x = i - y * image_width;
-
-			color c = read_color_raw(t->buff, pointer * 3);
-			write_color_raw(image_buffer, (y * image_width + x) * 3, c);
-
-			pointer++;
-		}
+		check_bvh4_edges(1000000);
+		benchmark_intersections(1000000);
+		benchmark_primary_rays(session, 4);
+		benchmark_shadow_rays(session, 1000000);
+		benchmark_secondary_rays(session, 4);
 	}
+	session.render(image_buffer.data(), sample_counts, startTime);
 
 	//Save bitmap
 	CHAR mypicturespath[MAX_PATH];
@@ -507,13 +1009,20 @@ int main()
 	if (CreateDirectory(folderPath.c_str(), NULL) || ERROR_ALREADY_EXISTS == GetLastError())
 	{
 		string path = folderPath + "\\" + ss.str() + ".bmp";
-		SaveBitmapToFile((BYTE*)image_buffer, image_width, image_height, 24, 0, path.c_str());
+		SaveBitmapToFile(image_buffer.data(), image_width, image_height, 24, 0, path.c_str());
+
+		if (adaptive.enabled)
+		{
+			vector<BYTE> heatmap(image_buffer.size());
+			write_sample_heatmap(heatmap.data(), sample_counts, samples_per_pixel);
+			string heatmap_path = folderPath + "\\" + ss.str() + "_samples.bmp";
+			SaveBitmapToFile(heatmap.data(), image_width, image_height, 24, 0, heatmap_path.c_str());
+		}
 	}
 	else
 	{
 		std::cerr << "ERROR: Render could not be saved!";
 	}
-	delete[] image_buffer;
 
 	std::cerr << "\nRender completed in " << duration_cast<microseconds>(high_resolution_clock::now() - startTime).count() / 1000000.0 << "s.\n";
 	Beep(1000, 200);
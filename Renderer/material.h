@@ -5,11 +5,27 @@
 #include "hittable.h"
 #include "texture.h"
 
+enum class bounce_type
+{
+	diffuse,
+	specular,
+	transmission
+};
+
 class material
 {
 public:
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
 	virtual color emitted(double u, double v, const point3& p) const { return color(0.0, 0.0, 0.0); }
+	virtual bounce_type bounce(const hit_record& rec, const ray& scattered) const { return bounce_type::diffuse; } //kind of the last scatter, for per-kind depth limits
+	virtual bool is_emitter() const { return false; }
+
+	//Materials whose scatter() density is known take part in light sampling:
+	//scattering_pdf() is the solid angle density scatter() picks direction with, and
+	//scattering_value() the brdf times cosine, so attenuation == scattering_value() / scattering_pdf()
+	virtual bool samples_lights() const { return false; }
+	virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const { return 0.0; }
+	virtual color scattering_value(const ray& r_in, const hit_record& rec, const vec3& direction) const { return color(0.0); }
 };
 
 class lambertian : public material
@@ -24,11 +40,25 @@ public:
 
 		if (scatter_direction.near_zero()) scatter_direction = rec.normal;
 
-		scattered = ray(rec.p, scatter_direction, r_in.time());
+		scattered = ray(offset_ray_origin(rec, scatter_direction), scatter_direction, r_in.time());
 		attenuation = albedo->value(rec.u, rec.v, rec.p);
 		return true;
 	}
 
+	virtual bool samples_lights() const override { return true; }
+
+	virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		//normal + random_unit_vector() is cosine distributed
+		auto cosine = dot(unit_vector(direction), rec.normal);
+		return cosine > 0.0 ? cosine / pi : 0.0;
+	}
+
+	virtual color scattering_value(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		return albedo->value(rec.u, rec.v, rec.p) * scattering_pdf(r_in, rec, direction);
+	}
+
 public:
 	shared_ptr<texture> albedo;
 };
@@ -41,13 +71,41 @@ public:
 
 	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
 	{
-		vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-		scattered = ray(rec.p, reflected + roughness * random_in_unit_sphere(), r_in.time());
+		vec3 reflected = reflect(r_in.unit_dir, rec.normal);
+		vec3 direction = reflected + roughness * random_in_unit_sphere();
+		scattered = ray(offset_ray_origin(rec, direction), direction, r_in.time());
 		attenuation = albedo->value(rec.u, rec.v, rec.p);
 
 		return dot(scattered.direction(), rec.normal) > 0;
 	}
 
+	virtual bounce_type bounce(const hit_record& rec, const ray& scattered) const override { return bounce_type::specular; }
+
+	virtual bool samples_lights() const override { return roughness > 0.0; } //a perfect mirror is a delta lobe
+
+	virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		//scatter() picks a point uniformly in the ball of radius roughness around the mirror direction,
+		//so the density along a unit direction is the ball's density integrated over t^2 dt on its chord
+		vec3 reflected = reflect(r_in.unit_dir, rec.normal);
+		auto c = dot(unit_vector(direction), reflected);
+		auto discriminant = roughness * roughness - (1.0 - c * c);
+		if (discriminant <= 0.0) return 0.0;
+
+		auto half_chord = sqrt(discriminant);
+		auto t1 = c + half_chord;
+		auto t0 = fmax(c - half_chord, 0.0);
+		if (t1 <= 0.0) return 0.0;
+
+		return (t1 * t1 * t1 - t0 * t0 * t0) / (4.0 * pi * roughness * roughness * roughness);
+	}
+
+	virtual color scattering_value(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		if (dot(direction, rec.normal) <= 0.0) return color(0.0); //scatter() absorbs these
+		return albedo->value(rec.u, rec.v, rec.p) * scattering_pdf(r_in, rec, direction);
+	}
+
 public:
 	shared_ptr<texture> albedo;
 	double roughness;
@@ -64,7 +122,7 @@ public:
 		attenuation = albedo;
 		double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
-		vec3 unit_direction = unit_vector(r_in.direction());
+		const vec3& unit_direction = r_in.unit_dir;
 		double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
 		double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
 
@@ -79,10 +137,15 @@ public:
 			scatter_direction = refract(unit_direction, rec.normal, refraction_ratio);
 		}
 
-		scattered = ray(rec.p, scatter_direction, r_in.time());
+		scattered = ray(offset_ray_origin(rec, scatter_direction), scatter_direction, r_in.time());
 		return true;
 	}
 
+	virtual bounce_type bounce(const hit_record& rec, const ray& scattered) const override
+	{
+		return dot(scattered.direction(), rec.normal) < 0.0 ? bounce_type::transmission : bounce_type::specular;
+	}
+
 public:
 	color albedo;
 	double ir; //index of reflection
@@ -108,6 +171,8 @@ public:
 		return emit->value(u, v, p) * intst;
 	}
 
+	virtual bool is_emitter() const override { return true; }
+
 public:
 	shared_ptr<texture> emit;
 	double intst;
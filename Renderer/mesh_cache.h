@@ -0,0 +1,297 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include "collection.h"
+
+#include "triangle_mesh.h"
+#include "obj_loader.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+//Read-only view of a whole file. The pages come from the OS file cache and are shared by every process
+//mapping the same file, so several renders of one scene on a host hold the mesh in memory once
+class mapped_file
+{
+public:
+	mapped_file(const char* filename)
+	{
+#ifdef _WIN32
+		file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (file == INVALID_HANDLE_VALUE) return;
+
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) return;
+
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping == nullptr) return;
+
+		void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (view == nullptr) return;
+
+		bytes = static_cast<const uint8_t*>(view);
+		size = static_cast<size_t>(file_size.QuadPart);
+#else
+		int file = open(filename, O_RDONLY);
+		if (file < 0) return;
+
+		struct stat info;
+		if (fstat(file, &info) == 0 && info.st_size > 0)
+		{
+			void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, file, 0);
+			if (view != MAP_FAILED)
+			{
+				bytes = static_cast<const uint8_t*>(view);
+				size = static_cast<size_t>(info.st_size);
+			}
+		}
+		close(file); //the mapping keeps its own reference
+#endif
+	}
+
+	~mapped_file()
+	{
+#ifdef _WIN32
+		if (bytes) UnmapViewOfFile(bytes);
+		if (mapping) CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+		if (bytes) munmap(const_cast<uint8_t*>(bytes), size);
+#endif
+	}
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	bool valid() const { return bytes != nullptr; }
+
+public:
+	const uint8_t* bytes = nullptr; //page aligned
+	size_t size = 0;
+
+private:
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = nullptr;
+#endif
+};
+
+//Binary mesh cache: a header, then the mesh_arrays of a triangle_mesh exactly as they sit in memory, each
+//section 64-byte aligned. Loading only validates the header and points a mesh at the mapped sections.
+//The layout depends on the build (precision, SIMD vec3): the file name carries it, so the builds keep caches of
+//their own, and the header records it. Mismatching files are rebuilt
+const char mesh_cache_magic[8] = { 'R', 'T', 'M', 'E', 'S', 'H', '\0', '\0' };
+const uint32_t mesh_cache_version = 2; //2: BVH depth is bounded, trees in older caches may not be
+const size_t mesh_cache_alignment = 64;
+
+enum mesh_cache_section { cache_positions, cache_normals, cache_uvs, cache_indices, cache_nodes, cache_section_count };
+
+struct mesh_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t real_size;
+	uint32_t vec3_size;
+	uint32_t node_size;
+	uint64_t source_size; //size and modification time of the file the mesh was loaded from
+	int64_t source_time;
+	uint64_t vertex_count;
+	uint64_t triangle_count;
+	uint64_t node_count;
+	uint64_t offsets[cache_section_count]; //0 for absent sections
+	uint64_t sizes[cache_section_count];
+	uint64_t file_size;
+};
+
+inline bool source_signature(const char* filename, uint64_t& size, int64_t& time)
+{
+#ifdef _WIN32
+	struct _stat64 info;
+	if (_stat64(filename, &info) != 0) return false;
+#else
+	struct stat info;
+	if (stat(filename, &info) != 0) return false;
+#endif
+	size = static_cast<uint64_t>(info.st_size);
+	time = static_cast<int64_t>(info.st_mtime);
+	return true;
+}
+
+//Bytes a section takes if the mesh has it
+inline uint64_t mesh_cache_section_size(const mesh_cache_header& header, int section)
+{
+	switch (section)
+	{
+	case cache_positions: return header.vertex_count * sizeof(point3);
+	case cache_normals: return header.vertex_count * sizeof(vec3);
+	case cache_uvs: return header.vertex_count * 2 * sizeof(float);
+	case cache_indices: return header.triangle_count * 3 * sizeof(uint32_t);
+	default: return header.node_count * sizeof(linear_bvh_node);
+	}
+}
+
+inline mesh_cache_header mesh_cache_layout(const mesh_arrays& arrays)
+{
+	mesh_cache_header header = {};
+	memcpy(header.magic, mesh_cache_magic, sizeof(header.magic));
+	header.version = mesh_cache_version;
+	header.real_size = sizeof(real);
+	header.vec3_size = sizeof(vec3);
+	header.node_size = sizeof(linear_bvh_node);
+	header.vertex_count = arrays.vertex_count;
+	header.triangle_count = arrays.triangle_count;
+	header.node_count = arrays.node_count;
+
+	uint64_t offset = sizeof(mesh_cache_header);
+	for (int i = 0; i < cache_section_count; i++)
+	{
+		if ((i == cache_normals && !arrays.normals) || (i == cache_uvs && !arrays.uvs)) continue;
+
+		header.sizes[i] = mesh_cache_section_size(header, i);
+		offset = (offset + mesh_cache_alignment - 1) & ~uint64_t(mesh_cache_alignment - 1);
+		header.offsets[i] = offset;
+		offset += header.sizes[i];
+	}
+	header.file_size = offset;
+
+	return header;
+}
+
+//Cache of an OBJ file next to it, named after this build's layout: e.g. "bunny.obj.r64v24.cache" for doubles,
+//"bunny.obj.r32v16.cache" for floats with the SIMD padding
+inline std::string mesh_cache_filename(const char* filename)
+{
+	return std::string(filename) + ".r" + std::to_string(8 * sizeof(real)) + "v" + std::to_string(sizeof(vec3)) + ".cache";
+}
+
+//Name for a file no other writer uses, in the same directory as filename so it can be renamed over it
+inline std::string mesh_cache_temp_filename(const char* filename)
+{
+	static std::atomic<uint32_t> counter(0);
+#ifdef _WIN32
+	unsigned long process = GetCurrentProcessId();
+#else
+	long process = static_cast<long>(getpid());
+#endif
+	return std::string(filename) + ".tmp" + std::to_string(process) + "_" + std::to_string(counter++);
+}
+
+//Puts from in place of to in one step: a reader opening to sees either file whole
+inline bool replace_file(const char* from, const char* to)
+{
+#ifdef _WIN32
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return std::rename(from, to) == 0;
+#endif
+}
+
+bool write_mesh_cache(const mesh_arrays& arrays, const mesh_cache_header& header, const char* filename)
+{
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+	if (!file) return false;
+
+	const void* sections[cache_section_count] = { arrays.positions, arrays.normals, arrays.uvs, arrays.indices, arrays.nodes };
+	const char zeros[mesh_cache_alignment] = {};
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	uint64_t written = sizeof(header);
+	for (int i = 0; i < cache_section_count; i++)
+	{
+		if (header.sizes[i] == 0) continue;
+		file.write(zeros, header.offsets[i] - written);
+		file.write(static_cast<const char*>(sections[i]), header.sizes[i]);
+		written = header.offsets[i] + header.sizes[i];
+	}
+
+	file.close();
+	return static_cast<bool>(file);
+}
+
+//Writes mesh to filename, recording the source file it was loaded from so stale caches are noticed. Other
+//processes may have the old cache mapped, and truncating it would pull their pages away (SIGBUS on POSIX).
+//The new cache is written to a file of its own and renamed over the old one, so their mappings keep the old file
+bool save_mesh_cache(const triangle_mesh& mesh, const char* filename, const char* source_filename)
+{
+	mesh_cache_header header = mesh_cache_layout(mesh.arrays);
+	if (!source_signature(source_filename, header.source_size, header.source_time)) return false;
+
+	std::string temp_filename = mesh_cache_temp_filename(filename);
+	if (!write_mesh_cache(mesh.arrays, header, temp_filename.c_str()) || !replace_file(temp_filename.c_str(), filename))
+	{
+		std::remove(temp_filename.c_str());
+		return false;
+	}
+	return true;
+}
+
+//Maps a cache written by save_mesh_cache(). Returns nullptr if the file is missing, was written by a build with
+//another layout, or no longer matches its source file
+shared_ptr<triangle_mesh> load_mesh_cache(const char* filename, const char* source_filename, shared_ptr<material> m)
+{
+	auto file = make_shared<mapped_file>(filename);
+	if (!file->valid() || file->size < sizeof(mesh_cache_header)) return nullptr;
+
+	const mesh_cache_header& header = *reinterpret_cast<const mesh_cache_header*>(file->bytes);
+	uint64_t source_size;
+	int64_t source_time;
+	if (memcmp(header.magic, mesh_cache_magic, sizeof(header.magic)) != 0 || header.version != mesh_cache_version) return nullptr;
+	if (header.real_size != sizeof(real) || header.vec3_size != sizeof(vec3) || header.node_size != sizeof(linear_bvh_node)) return nullptr;
+	if (!source_signature(source_filename, source_size, source_time) || header.source_size != source_size || header.source_time != source_time) return nullptr;
+
+	//The sections the header describes must be the ones this build would write, inside the file
+	for (int i = 0; i < cache_section_count; i++)
+	{
+		bool optional = i == cache_normals || i == cache_uvs;
+		if (header.sizes[i] == 0 && optional) continue;
+		if (header.sizes[i] == 0 || header.sizes[i] != mesh_cache_section_size(header, i) || header.offsets[i] % mesh_cache_alignment != 0
+			|| header.offsets[i] + header.sizes[i] > file->size) return nullptr;
+	}
+
+	mesh_arrays arrays;
+	arrays.vertex_count = static_cast<size_t>(header.vertex_count);
+	arrays.triangle_count = static_cast<size_t>(header.triangle_count);
+	arrays.node_count = static_cast<size_t>(header.node_count);
+
+	auto section = [&](mesh_cache_section i) { return header.sizes[i] != 0 ? file->bytes + header.offsets[i] : nullptr; };
+	arrays.positions = reinterpret_cast<const point3*>(section(cache_positions));
+	arrays.normals = reinterpret_cast<const vec3*>(section(cache_normals));
+	arrays.uvs = reinterpret_cast<const float*>(section(cache_uvs));
+	arrays.indices = reinterpret_cast<const uint32_t*>(section(cache_indices));
+	arrays.nodes = reinterpret_cast<const linear_bvh_node*>(section(cache_nodes));
+
+	return make_shared<triangle_mesh>(arrays, file, m);
+}
+
+//Loads an OBJ file through its cache next to it (mesh_cache_filename()): the cache is mapped if it is current,
+//otherwise the OBJ is parsed, its BVH built and the cache replaced for the next start
+shared_ptr<triangle_mesh> load_obj_cached(const char* filename, shared_ptr<material> m, const bvh_build_options& options = bvh_build_options(), bvh_stats* stats = nullptr)
+{
+	std::string cache_filename = mesh_cache_filename(filename);
+
+	auto mesh = load_mesh_cache(cache_filename.c_str(), filename, m);
+	if (mesh) return mesh;
+
+	mesh = load_obj(filename, m, options, stats);
+	if (mesh && !save_mesh_cache(*mesh, cache_filename.c_str(), filename))
+	{
+		std::cerr << "WARNING: Could not write mesh cache " << cache_filename << ".\n";
+	}
+
+	return mesh;
+}
+
+#endif
\ No newline at end of file
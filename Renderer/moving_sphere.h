@@ -12,6 +12,8 @@ public:
 		: center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m) {};
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual void finalize(const ray& r, hit_record& rec) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
 	point3 center(double time) const;
@@ -19,7 +21,7 @@ public:
 public:
 	point3 center0, center1;
 	double time0, time1;
-	double radius;
+	real radius;
 	shared_ptr<material> mat_ptr;
 };
 
@@ -29,6 +31,14 @@ point3 moving_sphere::center(double time) const
 }
 
 bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
+	return true;
+}
+
+bool moving_sphere::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
 	vec3 oc = r.origin() - center(r.time());
 	auto a = r.direction().length_squared();
@@ -47,12 +57,20 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
 	}
 
 	rec.t = root;
+	rec.object = this;
+	rec.sampled_light = false;
+	return true;
+}
+
+void moving_sphere::finalize(const ray& r, hit_record& rec) const
+{
 	rec.p = r.at(rec.t);
-	vec3 outward_normal = (rec.p - center(r.time())) / radius;
+	point3 current_center = center(r.time());
+	rec.p = current_center + (rec.p - current_center) * (radius / (rec.p - current_center).length()); //back onto the surface, as in sphere::hit
+	rec.p_scale = max_magnitude(current_center) + radius;
+	vec3 outward_normal = (rec.p - current_center) / radius;
 	rec.set_face_normal(r, outward_normal);
-	rec.mat_ptr = mat_ptr;
-
-	return true;
+	rec.mat_ptr = mat_ptr.get();
 }
 
 bool moving_sphere::bounding_box(double _time0, double _time1, aabb& output_box) const
@@ -0,0 +1,237 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "collection.h"
+
+#include "triangle_mesh.h"
+
+//Wavefront OBJ reader. The file is streamed line by line into the mesh's flat arrays, so only the mesh itself
+//has to fit in memory. Polygons are split into fans, negative (relative) indices are resolved, and corners that
+//share their position, uv and normal indices share one vertex. Groups, objects and materials are ignored.
+//A loader reads a single file; load_obj() below is the usual way in
+class obj_loader
+{
+public:
+	obj_loader(shared_ptr<material> m) : mat_ptr(m) {}
+
+	shared_ptr<triangle_mesh> load(const char* filename, const bvh_build_options& options = bvh_build_options(), bvh_stats* stats = nullptr);
+
+private:
+	struct corner
+	{
+		long position, uv, normal; //0-based, -1 if the corner has none
+	};
+
+	//One output vertex per distinct (position, uv, normal) triple, chained per position
+	struct vertex_slot
+	{
+		long uv, normal;
+		uint32_t vertex;
+		uint32_t next;
+	};
+
+	bool parse_face(const char* s, size_t line_number);
+	bool parse_corner(const char*& s, corner& c) const;
+	uint32_t vertex_for(const corner& c);
+
+private:
+	shared_ptr<material> mat_ptr;
+
+	std::vector<point3> file_positions;
+	std::vector<float> file_uvs;
+	std::vector<vec3> file_normals;
+
+	std::vector<point3> positions;
+	std::vector<float> uvs;
+	std::vector<vec3> normals;
+	std::vector<uint32_t> indices;
+	bool every_corner_has_uv = true;
+	bool every_corner_has_normal = true;
+
+	std::vector<uint32_t> first_slot; //per file position, UINT32_MAX while it has no vertex yet
+	std::vector<vertex_slot> slots;
+	std::vector<uint32_t> face; //vertices of the polygon being read
+	const char* filename = "";
+};
+
+inline const char* skip_spaces(const char* s)
+{
+	while (*s == ' ' || *s == '\t') s++;
+	return s;
+}
+
+shared_ptr<triangle_mesh> obj_loader::load(const char* _filename, const bvh_build_options& options, bvh_stats* stats)
+{
+	filename = _filename;
+	std::ifstream file(filename);
+	if (!file)
+	{
+		std::cerr << "ERROR: Could not load mesh " << filename << ".\n";
+		return nullptr;
+	}
+
+	std::string line;
+	size_t line_number = 0;
+	while (std::getline(file, line))
+	{
+		line_number++;
+		const char* s = skip_spaces(line.c_str());
+		char* end;
+
+		if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t'))
+		{
+			double x = strtod(s + 2, &end);
+			double y = strtod(end, &end);
+			double z = strtod(end, &end);
+			file_positions.push_back(point3(x, y, z));
+		}
+		else if (s[0] == 'v' && s[1] == 't' && (s[2] == ' ' || s[2] == '\t'))
+		{
+			double u = strtod(s + 3, &end);
+			double v = strtod(end, &end);
+			file_uvs.push_back(static_cast<float>(u));
+			file_uvs.push_back(static_cast<float>(v));
+		}
+		else if (s[0] == 'v' && s[1] == 'n' && (s[2] == ' ' || s[2] == '\t'))
+		{
+			double x = strtod(s + 3, &end);
+			double y = strtod(end, &end);
+			double z = strtod(end, &end);
+			file_normals.push_back(vec3(x, y, z));
+		}
+		else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t'))
+		{
+			if (!parse_face(s + 2, line_number)) return nullptr;
+		}
+	}
+
+	if (indices.empty())
+	{
+		std::cerr << "ERROR: Mesh " << filename << " has no faces.\n";
+		return nullptr;
+	}
+
+	//The file's arrays and the vertex lookup are done with; free them before the BVH build needs its memory
+	std::vector<point3>().swap(file_positions);
+	std::vector<float>().swap(file_uvs);
+	std::vector<vec3>().swap(file_normals);
+	std::vector<uint32_t>().swap(first_slot);
+	std::vector<vertex_slot>().swap(slots);
+
+	return make_shared<triangle_mesh>(std::move(positions), std::move(indices), mat_ptr, std::move(normals), std::move(uvs), options, stats);
+}
+
+bool obj_loader::parse_face(const char* s, size_t line_number)
+{
+	face.clear();
+
+	corner c;
+	for (s = skip_spaces(s); *s != '\0' && *s != '\r' && *s != '#'; s = skip_spaces(s))
+	{
+		if (!parse_corner(s, c))
+		{
+			std::cerr << "ERROR: Mesh " << filename << ", line " << line_number << ": invalid face.\n";
+			return false;
+		}
+		face.push_back(vertex_for(c));
+	}
+
+	if (face.size() < 3)
+	{
+		std::cerr << "ERROR: Mesh " << filename << ", line " << line_number << ": face with fewer than 3 vertices.\n";
+		return false;
+	}
+
+	for (size_t i = 1; i + 1 < face.size(); i++)
+	{
+		indices.push_back(face[0]);
+		indices.push_back(face[i]);
+		indices.push_back(face[i + 1]);
+	}
+
+	return true;
+}
+
+//Reads one "v", "v/vt", "v//vn" or "v/vt/vn" corner and checks its indices against what the file has defined so far
+bool obj_loader::parse_corner(const char*& s, corner& c) const
+{
+	auto resolve = [](long index, size_t count, long& output)
+	{
+		output = index > 0 ? index - 1 : static_cast<long>(count) + index;
+		return index != 0 && output >= 0 && output < static_cast<long>(count);
+	};
+
+	char* end;
+	long index = strtol(s, &end, 10);
+	if (end == s || !resolve(index, file_positions.size(), c.position)) return false;
+	s = end;
+
+	c.uv = c.normal = -1;
+	if (*s != '/') return true;
+
+	s++;
+	if (*s != '/')
+	{
+		index = strtol(s, &end, 10);
+		if (end == s || !resolve(index, file_uvs.size() / 2, c.uv)) return false;
+		s = end;
+	}
+
+	if (*s != '/') return true;
+
+	s++;
+	index = strtol(s, &end, 10);
+	if (end == s || !resolve(index, file_normals.size(), c.normal)) return false;
+	s = end;
+	return true;
+}
+
+uint32_t obj_loader::vertex_for(const corner& c)
+{
+	if (first_slot.size() < file_positions.size()) first_slot.resize(file_positions.size(), UINT32_MAX);
+
+	for (uint32_t slot = first_slot[c.position]; slot != UINT32_MAX; slot = slots[slot].next)
+	{
+		if (slots[slot].uv == c.uv && slots[slot].normal == c.normal) return slots[slot].vertex;
+	}
+
+	uint32_t vertex = static_cast<uint32_t>(positions.size());
+	positions.push_back(file_positions[c.position]);
+
+	//Attributes only some corners have cannot be interpolated, the mesh falls back to barycentrics or flat shading
+	if (every_corner_has_uv && c.uv >= 0)
+	{
+		uvs.push_back(file_uvs[2 * c.uv]);
+		uvs.push_back(file_uvs[2 * c.uv + 1]);
+	}
+	else if (every_corner_has_uv)
+	{
+		every_corner_has_uv = false;
+		std::vector<float>().swap(uvs);
+	}
+
+	if (every_corner_has_normal && c.normal >= 0) normals.push_back(file_normals[c.normal]);
+	else if (every_corner_has_normal)
+	{
+		every_corner_has_normal = false;
+		std::vector<vec3>().swap(normals);
+	}
+
+	slots.push_back({ c.uv, c.normal, vertex, first_slot[c.position] });
+	first_slot[c.position] = static_cast<uint32_t>(slots.size() - 1);
+	return vertex;
+}
+
+//Returns nullptr, after reporting the problem, if the mesh could not be loaded
+shared_ptr<triangle_mesh> load_obj(const char* filename, shared_ptr<material> m, const bvh_build_options& options = bvh_build_options(), bvh_stats* stats = nullptr)
+{
+	return obj_loader(m).load(filename, options, stats);
+}
+
+#endif
\ No newline at end of file
@@ -7,21 +7,47 @@ class ray
 {
 public:
 	ray() {}
-	ray(const point3& origin, const vec3& direction, double time = 0.0) : orig(origin), dir(direction), tm(time) {}
+	ray(const point3& origin, const vec3& direction, double time = 0.0) : orig(origin), dir(direction), tm(time)
+	{
+		inv_dir = vec3(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+		sign[0] = inv_dir.x() < 0.0;
+		sign[1] = inv_dir.y() < 0.0;
+		sign[2] = inv_dir.z() < 0.0;
+		dir_length = dir.length();
+		unit_dir = dir / dir_length;
+	}
 
 	point3 origin() const { return orig; }
 	vec3 direction() const { return dir; }
 	double time() const { return tm; }
 
+	vec3 inv_direction() const { return inv_dir; }
+	vec3 unit_direction() const { return unit_dir; }
+	double direction_length() const { return dir_length; }
+
 	point3 at(double t) const
 	{
 		return orig + t * dir;
 	}
 
+	//Same direction from another origin, without recomputing the direction's derived values
+	ray moved_to(const point3& origin) const
+	{
+		ray moved = *this;
+		moved.orig = origin;
+		return moved;
+	}
+
 public:
 	point3 orig;
 	vec3 dir;
 	double tm;
+
+	//Derived from dir once, when the ray is made, for the intersection routines
+	vec3 inv_dir;
+	vec3 unit_dir;
+	double dir_length;
+	int sign[3]; //1 where the direction is negative, picks the near slab of a box
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,106 @@
+#ifndef RAY_SORT_H
+#define RAY_SORT_H
+
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "collection.h"
+
+#include "aabb.h"
+#include "ray.h"
+
+//Ray reordering. Scattered rays leave their surfaces in every direction, so neighbours in a batch traverse
+//different parts of the BVH. Keyed by the octant they head into and the Morton code of the cell they start in,
+//rays that fetch the same nodes end up next to each other
+
+const int ray_sort_cell_bits = 9; //per axis, a 512^3 grid over the scene's bounds
+const int ray_sort_key_bits = 3 + 3 * ray_sort_cell_bits;
+
+//Spreads the low 9 bits of v two bits apart, for interleaving three coordinates
+inline uint32_t morton_spread(uint32_t v)
+{
+	v &= 0x1ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+//Direction octant on top, so a bin holds rays going the same way, then the origin's cell in Morton order.
+//Origins outside bounds go to the nearest border cell
+inline uint32_t ray_sort_key(const ray& r, const aabb& bounds)
+{
+	const int cells = 1 << ray_sort_cell_bits;
+	uint32_t key = 0;
+	for (int a = 0; a < 3; a++)
+	{
+		double extent = bounds.maxy()[a] - bounds.miny()[a];
+		double offset = extent > 0.0 ? (r.origin()[a] - bounds.miny()[a]) / extent * cells : 0.0;
+		uint32_t cell = offset <= 0.0 ? 0 : offset >= cells - 1 ? cells - 1 : static_cast<uint32_t>(offset);
+		key |= morton_spread(cell) << a;
+
+		if (r.direction()[a] < 0.0) key |= 1u << (3 * ray_sort_cell_bits + a);
+	}
+	return key;
+}
+
+//Sorts batches of rays by their keys. Holds its buffers between batches, one per thread
+class ray_sorter
+{
+public:
+	ray_sorter() {}
+	ray_sorter(const aabb& _bounds) : bounds(_bounds) {}
+
+	//Reorders items so the rays ray_of(item) returns come in key order. Stable, so equal keys keep the order they
+	//came in and the result never depends on anything but the rays
+	template <typename RayOf>
+	void sort(uint32_t* items, size_t count, RayOf ray_of);
+
+public:
+	aabb bounds;
+
+private:
+	std::vector<uint32_t> keys, key_scratch, item_scratch;
+};
+
+//Least significant digit radix sort, 10 bits a pass
+template <typename RayOf>
+void ray_sorter::sort(uint32_t* items, size_t count, RayOf ray_of)
+{
+	const int digit_bits = 10;
+	const uint32_t digit_mask = (1u << digit_bits) - 1;
+
+	keys.resize(count);
+	key_scratch.resize(count);
+	item_scratch.resize(count);
+	for (size_t i = 0; i < count; i++) keys[i] = ray_sort_key(ray_of(items[i]), bounds);
+
+	uint32_t* key_from = keys.data();
+	uint32_t* key_to = key_scratch.data();
+	uint32_t* item_from = items;
+	uint32_t* item_to = item_scratch.data();
+	for (int shift = 0; shift < ray_sort_key_bits; shift += digit_bits)
+	{
+		std::array<uint32_t, (1u << digit_bits) + 1> start = {};
+		for (size_t i = 0; i < count; i++) start[((key_from[i] >> shift) & digit_mask) + 1]++;
+		for (size_t d = 1; d < start.size(); d++) start[d] += start[d - 1];
+
+		for (size_t i = 0; i < count; i++)
+		{
+			uint32_t slot = start[(key_from[i] >> shift) & digit_mask]++;
+			key_to[slot] = key_from[i];
+			item_to[slot] = item_from[i];
+		}
+		std::swap(key_from, key_to);
+		std::swap(item_from, item_to);
+	}
+
+	if (item_from != items)
+	{
+		for (size_t i = 0; i < count; i++) items[i] = item_from[i];
+	}
+}
+
+#endif
\ No newline at end of file
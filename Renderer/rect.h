@@ -3,6 +3,7 @@
 
 #include "collection.h"
 #include "hittable.h"
+#include "material.h"
 
 class rect : public hittable
 {
@@ -19,38 +20,62 @@ public:
 	}
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual void finalize(const ray& r, hit_record& rec) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+	virtual bool emissive() const override { return mat->is_emitter(); }
+	virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
+
 public:
 	point3 pos;
 	vec3 i, j;
 	shared_ptr<material> mat;
-	double abs_i, abs_j;
+	real abs_i, abs_j;
 	vec3 outward_normal;
 };
 
 bool rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
-	vec3 ray_dir = unit_vector(r.direction());
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
+	return true;
+}
+
+bool rect::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	const vec3& ray_dir = r.unit_dir;
 	vec3 relative_pos = r.origin() - pos;
 
-	double under = dot(-ray_dir, outward_normal);
+	real under = dot(-ray_dir, outward_normal);
 	if (under == 0) return false;
 
-	auto t = dot(outward_normal, relative_pos) / (under * r.direction().length());
+	auto t = dot(outward_normal, relative_pos) / (under * r.dir_length);
 	auto v = dot(cross(-ray_dir, j), relative_pos) / under;
 	auto u = dot(cross(i, -ray_dir), relative_pos) / under;
 	if (t < t_min || t > t_max || u < 0.0 || u > abs_i || v < 0.0 || v > abs_j) return false;
 
 	rec.t = t;
+	rec.local[0] = u;
+	rec.local[1] = v;
+	rec.object = this;
+	rec.sampled_light = false;
+	return true;
+}
+
+void rect::finalize(const ray& r, hit_record& rec) const
+{
 	rec.p = r.at(rec.t);
-	rec.set_face_normal(r, unit_vector(outward_normal));
-	rec.u = u / abs_i;
+	vec3 unit_normal = unit_vector(outward_normal);
+	rec.p -= dot(rec.p - pos, unit_normal) * unit_normal; //back onto the plane
+	rec.p_scale = max_magnitude(pos);
+	rec.set_face_normal(r, unit_normal);
+	rec.u = rec.local[0] / abs_i;
 	if (!rec.front_face) rec.u = 1.0 - rec.u;
-	rec.v = v / abs_j;
-	rec.mat_ptr = mat;
-
-	return true;
+	rec.v = rec.local[1] / abs_j;
+	rec.mat_ptr = mat.get();
 }
 
 bool rect::bounding_box(double time0, double time1, aabb& output_box) const
@@ -66,4 +91,22 @@ bool rect::bounding_box(double time0, double time1, aabb& output_box) const
 	return true;
 }
 
+double rect::pdf_value(const point3& origin, const vec3& direction) const
+{
+	hit_record rec;
+	if (!this->hit(ray(origin, direction), 0.0, infinity, rec)) return 0.0;
+
+	auto area = abs_i * abs_j * outward_normal.length(); //i and j need not be perpendicular
+	auto distance_squared = rec.t * rec.t * direction.length_squared();
+	auto cosine = fabs(dot(unit_vector(direction), rec.normal));
+	return distance_squared / (cosine * area);
+}
+
+vec3 rect::random(const point3& origin) const
+{
+	double r[2];
+	random_doubles(r, 2);
+	return pos - r[0] * abs_j * i - r[1] * abs_i * j - origin; //the parallelogram hit() accepts: u runs along -j, v along -i
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <vector>
+#include "collection.h"
+#include "color.h"
+
+struct adaptive_settings
+{
+	bool enabled = true;
+	int min_samples = 64; //every pixel gets at least this many before its variance is trusted
+	int batch_size = 16; //samples between convergence checks
+	double threshold = .004; //standard error of the pixel after gamma, about one step of an 8-bit channel
+	double gamma = 2.2; //the display curve the error is measured through
+};
+
+//Welford's running mean and variance of a pixel's luminance, next to the plain colour sum
+struct pixel_estimator
+{
+	int n = 0;
+	color sum = color(0.0);
+	double mean = 0.0;
+	double m2 = 0.0;
+
+	void add(const color& sample)
+	{
+		sum += sample;
+		double luminance = .2126 * sample.x() + .7152 * sample.y() + .0722 * sample.z();
+
+		n++;
+		double delta = luminance - mean;
+		mean += delta / n;
+		m2 += delta * (luminance - mean);
+	}
+
+	//Standard error of the mean carried through the gamma curve, so dark pixels need proportionally less absolute noise
+	double display_error(double gamma) const
+	{
+		if (n < 2) return infinity;
+
+		double standard_error = sqrt(m2 / (n - 1) / n);
+		double level = fmax(mean, .001);
+		return standard_error * pow(level, 1.0 / gamma - 1.0) / gamma;
+	}
+
+	bool converged(const adaptive_settings& settings) const
+	{
+		return n >= settings.min_samples && display_error(settings.gamma) <= settings.threshold;
+	}
+};
+
+//Blue (fewest samples) to red (max_samples) map of how many samples each pixel took, in the bitmap's BGR order
+void write_sample_heatmap(BYTE* buffer, const std::vector<int>& counts, int max_samples)
+{
+	for (size_t i = 0; i < counts.size(); i++)
+	{
+		double x = clamp(double(counts[i]) / max_samples, 0.0, 1.0);
+		color c(clamp(2.0 * x - .5, 0.0, 1.0), 1.0 - fabs(2.0 * x - 1.0), clamp(1.5 - 2.0 * x, 0.0, 1.0));
+
+		buffer[3 * i + 0] = static_cast<BYTE>(255.0 * c.z());
+		buffer[3 * i + 1] = static_cast<BYTE>(255.0 * c.y());
+		buffer[3 * i + 2] = static_cast<BYTE>(255.0 * c.x());
+	}
+}
+
+#endif
\ No newline at end of file
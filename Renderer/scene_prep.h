@@ -0,0 +1,131 @@
+#ifndef SCENE_PREP_H
+#define SCENE_PREP_H
+
+#include "collection.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "constant_medium.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "box.h"
+#include "linear_bvh.h"
+#include "wide_bvh.h"
+#include "instance.h"
+
+//Scene preparation, run once on the world before it is handed to the renderer
+
+//Copy of object with transform applied to its geometry, so rays reach it without being transformed at all.
+//Spheres and boxes take translations and uniform scales, not rotations, which would turn a sphere's texture coordinates and a box out of its axes.
+//Lists and BVHs are rebuilt over their baked children. Returns nullptr if some part cannot carry the transform itself
+shared_ptr<hittable> bake_transform(const shared_ptr<hittable>& object, const affine3& transform)
+{
+	double scale;
+	if (!transform.is_uniform_scale(scale)) return nullptr;
+
+	if (auto s = dynamic_cast<const sphere*>(object.get()))
+	{
+		return make_shared<sphere>(transform.point(s->center), s->radius * scale, s->mat_ptr, s->rend_in);
+	}
+	if (auto s = dynamic_cast<const moving_sphere*>(object.get()))
+	{
+		return make_shared<moving_sphere>(transform.point(s->center0), transform.point(s->center1), s->time0, s->time1, s->radius * scale, s->mat_ptr);
+	}
+
+	if (auto b = dynamic_cast<const box*>(object.get()))
+	{
+		return make_shared<box>(transform.point(b->box_min), transform.point(b->box_max), b->mat_ptr);
+	}
+
+	const std::vector<shared_ptr<hittable>>* children = nullptr;
+	if (auto list = dynamic_cast<const hittable_list*>(object.get())) children = &list->objects;
+	else if (auto tree = dynamic_cast<const bvh4*>(object.get())) children = &tree->objects;
+	else if (auto tree = dynamic_cast<const linear_bvh*>(object.get())) children = &tree->objects;
+	else return nullptr;
+
+	hittable_list baked;
+	baked.objects.reserve(children->size());
+	for (const auto& child : *children)
+	{
+		auto baked_child = bake_transform(child, transform);
+		if (!baked_child) return nullptr;
+		baked.add(baked_child);
+	}
+
+	if (dynamic_cast<const bvh4*>(object.get())) return make_shared<bvh4>(baked, 0.0, 1.0);
+	if (dynamic_cast<const linear_bvh*>(object.get())) return make_shared<linear_bvh>(baked, 0.0, 1.0);
+	return make_shared<hittable_list>(baked);
+}
+
+//Removes chains of translate, rotate_y and instance wrappers. Geometry nothing else references gets the combined
+//transform baked in; otherwise a chain of two or more becomes one instance, so a ray is transformed once on the
+//way in and its hit once on the way out. Lists and the boundaries of constant media are walked into; other BVHs
+//are not, their children have to be prepared before they are built.
+//Returns the replacement for object and counts the chains it removed
+shared_ptr<hittable> fold_transforms(const shared_ptr<hittable>& object, int& folded)
+{
+	affine3 transform = affine3::identity();
+	const shared_ptr<hittable>* link = &object;
+	bool shared = false; //baking a copy would then duplicate the geometry
+	int links = 0;
+
+	while (true)
+	{
+		shared = shared || link->use_count() > 1;
+
+		if (auto t = dynamic_cast<const translate*>(link->get()))
+		{
+			transform = transform * affine3::translation(t->offset);
+			link = &t->obj;
+		}
+		else if (auto r = dynamic_cast<const rotate_y*>(link->get()))
+		{
+			transform = transform * affine3{ { { r->cos_theta, 0, r->sin_theta, 0 }, { 0, 1, 0, 0 }, { -r->sin_theta, 0, r->cos_theta, 0 } } };
+			link = &r->obj;
+		}
+		else if (auto i = dynamic_cast<const instance*>(link->get()))
+		{
+			transform = transform * i->place.to_world;
+			link = &i->obj;
+		}
+		else break;
+
+		links++;
+	}
+
+	shared_ptr<hittable> inner = *link;
+	if (auto list = dynamic_cast<hittable_list*>(inner.get()))
+	{
+		for (auto& child : list->objects) child = fold_transforms(child, folded);
+	}
+	else if (auto medium = dynamic_cast<constant_medium*>(inner.get()))
+	{
+		medium->bound = fold_transforms(medium->bound, folded);
+	}
+
+	if (links == 0) return object;
+
+	if (!shared)
+	{
+		auto baked = bake_transform(inner, transform);
+		if (baked)
+		{
+			folded++;
+			return baked;
+		}
+	}
+
+	if (links < 2) return object; //a single wrapper is as cheap as the instance that would replace it
+
+	folded++;
+	return make_shared<instance>(inner, transform);
+}
+
+int fold_transforms(hittable_list& world)
+{
+	int folded = 0;
+	for (auto& object : world.objects) object = fold_transforms(object, folded);
+	return folded;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,101 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+struct tile
+{
+	int x0, y0; //inclusive
+	int x1, y1; //exclusive
+};
+
+//Interleaves the bits of x and y, so sorting by it walks the image along a Z-order curve
+inline uint32_t morton2(uint32_t x, uint32_t y)
+{
+	auto spread = [](uint32_t v)
+	{
+		v &= 0x0000ffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+
+	return spread(x) | (spread(y) << 1);
+}
+
+//Hands out image tiles to render threads without locks.
+//Tiles are kept in Morton order and every worker owns a contiguous run of them, so neighbouring
+//pixels (and the BVH nodes and texels they touch) stay on one core. A worker whose run is used up
+//steals tiles from the other runs; a single fetch_add claims a tile for both owners and thieves.
+class tile_scheduler
+{
+public:
+	tile_scheduler(int width, int height, int tile_size, int workers) : queues(workers)
+	{
+		int tiles_x = (width + tile_size - 1) / tile_size;
+		int tiles_y = (height + tile_size - 1) / tile_size;
+
+		std::vector<uint32_t> codes;
+		for (int ty = 0; ty < tiles_y; ty++)
+		{
+			for (int tx = 0; tx < tiles_x; tx++)
+			{
+				codes.push_back(morton2(tx, ty));
+				tiles.push_back({ tx * tile_size, ty * tile_size, (std::min)((tx + 1) * tile_size, width), (std::min)((ty + 1) * tile_size, height) });
+			}
+		}
+
+		std::vector<size_t> order(tiles.size());
+		for (size_t i = 0; i < order.size(); i++) order[i] = i;
+		std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return codes[a] < codes[b]; });
+
+		std::vector<tile> sorted;
+		for (auto i : order) sorted.push_back(tiles[i]);
+		tiles.swap(sorted);
+
+		for (int i = 0; i < workers; i++)
+		{
+			queues[i].next.store(static_cast<int>(tiles.size() * i / workers));
+			queues[i].end = static_cast<int>(tiles.size() * (i + 1) / workers);
+		}
+	}
+
+	bool next(int worker, tile& output)
+	{
+		int workers = static_cast<int>(queues.size());
+		for (int k = 0; k < workers; k++) //own run first, then the others in turn
+		{
+			auto& queue = queues[(worker + k) % workers];
+			if (queue.next.load(std::memory_order_relaxed) >= queue.end) continue;
+
+			int index = queue.next.fetch_add(1, std::memory_order_relaxed);
+			if (index < queue.end)
+			{
+				output = tiles[index];
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	size_t tile_count() const { return tiles.size(); }
+
+private:
+	struct tile_queue
+	{
+		std::atomic<int> next;
+		int end;
+		char pad[64 - sizeof(std::atomic<int>) - sizeof(int)]; //one queue per cache line
+	};
+
+	std::vector<tile> tiles;
+	std::vector<tile_queue> queues;
+};
+
+#endif
\ No newline at end of file
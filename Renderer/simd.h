@@ -0,0 +1,87 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+//Four real lanes for vec3: one SSE register in float mode, one AVX2 register or a pair of SSE2 registers
+//in double mode. vec3 keeps x, y, z in the first three lanes and 0 in the last one.
+//Loads and stores are unaligned, so vec3s on 32-bit heaps (8-byte aligned) work too
+
+#include <immintrin.h>
+
+#if defined(RENDERER_SINGLE_PRECISION)
+
+struct real4 { __m128 v; };
+
+inline real4 load4(const real* p) { return { _mm_loadu_ps(p) }; }
+inline void store4(real* p, real4 a) { _mm_storeu_ps(p, a.v); }
+inline real4 set4(real x) { return { _mm_set1_ps(x) }; }
+
+inline real4 add4(real4 a, real4 b) { return { _mm_add_ps(a.v, b.v) }; }
+inline real4 sub4(real4 a, real4 b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline real4 mul4(real4 a, real4 b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline real4 div4(real4 a, real4 b) { return { _mm_div_ps(a.v, b.v) }; }
+inline real4 min4(real4 a, real4 b) { return { _mm_min_ps(a.v, b.v) }; }
+inline real4 max4(real4 a, real4 b) { return { _mm_max_ps(a.v, b.v) }; }
+
+inline real4 yzx4(real4 a) { return { _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1)) }; }
+inline real4 zxy4(real4 a) { return { _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 1, 0, 2)) }; }
+
+//x + y + z, added in the same order as the scalar code
+inline real hsum3(real4 a)
+{
+	__m128 s = _mm_add_ss(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(1, 1, 1, 1)));
+	return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(a.v, a.v)));
+}
+
+#elif defined(__AVX2__)
+
+struct real4 { __m256d v; };
+
+inline real4 load4(const real* p) { return { _mm256_loadu_pd(p) }; }
+inline void store4(real* p, real4 a) { _mm256_storeu_pd(p, a.v); }
+inline real4 set4(real x) { return { _mm256_set1_pd(x) }; }
+
+inline real4 add4(real4 a, real4 b) { return { _mm256_add_pd(a.v, b.v) }; }
+inline real4 sub4(real4 a, real4 b) { return { _mm256_sub_pd(a.v, b.v) }; }
+inline real4 mul4(real4 a, real4 b) { return { _mm256_mul_pd(a.v, b.v) }; }
+inline real4 div4(real4 a, real4 b) { return { _mm256_div_pd(a.v, b.v) }; }
+inline real4 min4(real4 a, real4 b) { return { _mm256_min_pd(a.v, b.v) }; }
+inline real4 max4(real4 a, real4 b) { return { _mm256_max_pd(a.v, b.v) }; }
+
+inline real4 yzx4(real4 a) { return { _mm256_permute4x64_pd(a.v, _MM_SHUFFLE(3, 0, 2, 1)) }; }
+inline real4 zxy4(real4 a) { return { _mm256_permute4x64_pd(a.v, _MM_SHUFFLE(3, 1, 0, 2)) }; }
+
+inline real hsum3(real4 a)
+{
+	__m128d lo = _mm256_castpd256_pd128(a.v);
+	__m128d s = _mm_add_sd(lo, _mm_unpackhi_pd(lo, lo));
+	return _mm_cvtsd_f64(_mm_add_sd(s, _mm256_extractf128_pd(a.v, 1)));
+}
+
+#else
+
+struct real4 { __m128d lo, hi; }; //(x, y) and (z, 0)
+
+inline real4 load4(const real* p) { return { _mm_loadu_pd(p), _mm_loadu_pd(p + 2) }; }
+inline void store4(real* p, real4 a) { _mm_storeu_pd(p, a.lo); _mm_storeu_pd(p + 2, a.hi); }
+inline real4 set4(real x) { return { _mm_set1_pd(x), _mm_set1_pd(x) }; }
+
+inline real4 add4(real4 a, real4 b) { return { _mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi) }; }
+inline real4 sub4(real4 a, real4 b) { return { _mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi) }; }
+inline real4 mul4(real4 a, real4 b) { return { _mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi) }; }
+inline real4 div4(real4 a, real4 b) { return { _mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi) }; }
+inline real4 min4(real4 a, real4 b) { return { _mm_min_pd(a.lo, b.lo), _mm_min_pd(a.hi, b.hi) }; }
+inline real4 max4(real4 a, real4 b) { return { _mm_max_pd(a.lo, b.lo), _mm_max_pd(a.hi, b.hi) }; }
+
+//(y, z), (x, w) and (z, x), (y, w)
+inline real4 yzx4(real4 a) { return { _mm_shuffle_pd(a.lo, a.hi, 1), _mm_shuffle_pd(a.lo, a.hi, 2) }; }
+inline real4 zxy4(real4 a) { return { _mm_shuffle_pd(a.hi, a.lo, 0), _mm_shuffle_pd(a.lo, a.hi, 3) }; }
+
+inline real hsum3(real4 a)
+{
+	__m128d s = _mm_add_sd(a.lo, _mm_unpackhi_pd(a.lo, a.lo));
+	return _mm_cvtsd_f64(_mm_add_sd(s, a.hi));
+}
+
+#endif
+
+#endif
\ No newline at end of file
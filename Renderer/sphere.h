@@ -2,6 +2,7 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "material.h"
 #include "vec3.h"
 
 class sphere : public hittable
@@ -11,11 +12,17 @@ public:
 	sphere(point3 cen, double r, shared_ptr<material> m, bool render_inside = true) : center(cen), radius(r), mat_ptr(m), rend_in(render_inside) {};
 
 	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual void finalize(const ray& r, hit_record& rec) const override;
 	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+	virtual bool emissive() const override { return mat_ptr->is_emitter(); }
+	virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+	virtual vec3 random(const point3& origin) const override;
+
 public:
 	point3 center;
-	double radius;
+	real radius;
 	shared_ptr<material> mat_ptr;
 	bool rend_in;
 
@@ -38,6 +45,14 @@ private:
 };
 
 bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
+	return true;
+}
+
+bool sphere::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
 	vec3 oc = r.origin() - center;
 	auto a = r.direction().length_squared();
@@ -55,21 +70,23 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
 		if (root < t_min || root > t_max) return false;
 	}
 
+	if (!rend_in && half_b + root * a >= 0) return false; //dot(p - center, direction), the back side is not rendered
+
 	rec.t = root;
+	rec.object = this;
+	rec.sampled_light = false;
+	return true;
+}
+
+void sphere::finalize(const ray& r, hit_record& rec) const
+{
 	rec.p = r.at(rec.t);
+	rec.p = center + (rec.p - center) * (radius / (rec.p - center).length()); //back onto the surface, c's cancellation can leave it far off
+	rec.p_scale = max_magnitude(center) + radius;
 	vec3 outward_normal = (rec.p - center) / radius;
 	rec.set_face_normal(r, outward_normal);
 	get_sphere_uv(outward_normal, rec.u, rec.v);
-	rec.mat_ptr = mat_ptr;
-
-	if (rend_in)
-	{
-		return true;
-	}
-	else
-	{
-		return rec.front_face;
-	}
+	rec.mat_ptr = mat_ptr.get();
 }
 
 bool sphere::bounding_box(double time0, double time1, aabb& output_box) const
@@ -80,4 +97,45 @@ bool sphere::bounding_box(double time0, double time1, aabb& output_box) const
 	return true;
 }
 
+//Seen from outside, directions are drawn uniformly from the cone the sphere subtends;
+//from inside (e.g. a sky sphere), points are drawn uniformly over its surface
+double sphere::pdf_value(const point3& origin, const vec3& direction) const
+{
+	hit_record rec;
+	if (!this->hit(ray(origin, direction), 0.0, infinity, rec)) return 0.0;
+
+	auto distance_squared = (center - origin).length_squared();
+	if (distance_squared > radius * radius)
+	{
+		auto cos_theta_max = sqrt(1.0 - radius * radius / distance_squared);
+		return 1.0 / (2.0 * pi * (1.0 - cos_theta_max));
+	}
+
+	vec3 to_point = rec.p - origin;
+	auto cosine = fabs(dot(unit_vector(to_point), rec.normal));
+	return to_point.length_squared() / (cosine * 4.0 * pi * radius * radius);
+}
+
+vec3 sphere::random(const point3& origin) const
+{
+	vec3 to_center = center - origin;
+	auto distance_squared = to_center.length_squared();
+	if (distance_squared <= radius * radius) return center + radius * random_unit_vector() - origin;
+
+	double r[2];
+	random_doubles(r, 2);
+	auto cos_theta_max = sqrt(1.0 - radius * radius / distance_squared);
+	auto z = 1.0 + r[1] * (cos_theta_max - 1.0);
+	auto phi = 2.0 * pi * r[0];
+	auto sin_theta = sqrt(1.0 - z * z);
+
+	//Orthonormal basis around the direction to the center
+	vec3 w = unit_vector(to_center);
+	vec3 a = fabs(w.x()) > .9 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+	vec3 v = unit_vector(cross(w, a));
+	vec3 u = cross(w, v);
+
+	return cos(phi) * sin_theta * u + sin(phi) * sin_theta * v + z * w;
+}
+
 #endif
\ No newline at end of file
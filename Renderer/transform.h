@@ -0,0 +1,146 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "collection.h"
+#include "aabb.h"
+
+//Affine transform stored as the top three rows of a 4x4 matrix: columns 0-2 are the linear part, column 3 the translation
+struct affine3
+{
+	double m[3][4];
+
+	static affine3 identity()
+	{
+		return affine3{ { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } };
+	}
+
+	static affine3 translation(const vec3& offset)
+	{
+		return affine3{ { { 1, 0, 0, offset.x() }, { 0, 1, 0, offset.y() }, { 0, 0, 1, offset.z() } } };
+	}
+
+	static affine3 scaling(const vec3& factors)
+	{
+		return affine3{ { { factors.x(), 0, 0, 0 }, { 0, factors.y(), 0, 0 }, { 0, 0, factors.z(), 0 } } };
+	}
+
+	//Counterclockwise by angle degrees, looking down the axis towards the origin; rotation(vec3(0, 1, 0), a) turns like rotate_y(a)
+	static affine3 rotation(const vec3& axis, double angle)
+	{
+		vec3 a = unit_vector(axis);
+		double s = sin(deg2rad(angle));
+		double c = cos(deg2rad(angle));
+		double t = 1.0 - c;
+
+		return affine3{ {
+			{ t * a.x() * a.x() + c, t * a.x() * a.y() - s * a.z(), t * a.x() * a.z() + s * a.y(), 0 },
+			{ t * a.x() * a.y() + s * a.z(), t * a.y() * a.y() + c, t * a.y() * a.z() - s * a.x(), 0 },
+			{ t * a.x() * a.z() - s * a.y(), t * a.y() * a.z() + s * a.x(), t * a.z() * a.z() + c, 0 } } };
+	}
+
+	point3 point(const point3& p) const
+	{
+		return point3(
+			m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+			m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+			m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+	}
+
+	vec3 vector(const vec3& v) const
+	{
+		return vec3(
+			m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+			m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+			m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+	}
+
+	//Multiplies by the transposed linear part; the inverse transform's transpose carries normals
+	vec3 transposed_vector(const vec3& v) const
+	{
+		return vec3(
+			m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+			m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+			m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+	}
+
+	//Largest factor the transform stretches a point's magnitude by, bounds how rounding errors grow through it
+	double max_stretch() const
+	{
+		double output = 0.0;
+		for (int i = 0; i < 3; i++) output = fmax(output, fabs(m[i][0]) + fabs(m[i][1]) + fabs(m[i][2]));
+		return output;
+	}
+
+	//True if the linear part only scales, by the same positive factor along every axis
+	bool is_uniform_scale(double& scale) const
+	{
+		scale = m[0][0];
+		return scale > 0.0 && m[1][1] == scale && m[2][2] == scale
+			&& m[0][1] == 0.0 && m[0][2] == 0.0 && m[1][0] == 0.0 && m[1][2] == 0.0 && m[2][0] == 0.0 && m[2][1] == 0.0;
+	}
+
+	affine3 inverse() const
+	{
+		//Inverse of the linear part from its cofactors, then the translation taken back through it
+		double cof[3][3];
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+			{
+				int i1 = (i + 1) % 3, i2 = (i + 2) % 3, j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+				cof[i][j] = m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1];
+			}
+		}
+		double inv_det = 1.0 / (m[0][0] * cof[0][0] + m[0][1] * cof[0][1] + m[0][2] * cof[0][2]);
+
+		affine3 output;
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++) output.m[i][j] = cof[j][i] * inv_det;
+		}
+		for (int i = 0; i < 3; i++)
+		{
+			output.m[i][3] = -(output.m[i][0] * m[0][3] + output.m[i][1] * m[1][3] + output.m[i][2] * m[2][3]);
+		}
+
+		return output;
+	}
+
+	//World bounds of a transformed box, per axis the extremes of every linear term plus the translation (Arvo)
+	aabb box(const aabb& input) const
+	{
+		point3 minimum, maximum;
+		for (int i = 0; i < 3; i++)
+		{
+			double lo = m[i][3], hi = m[i][3];
+			for (int j = 0; j < 3; j++)
+			{
+				double a = m[i][j] * input.miny()[j];
+				double b = m[i][j] * input.maxy()[j];
+				lo += fmin(a, b);
+				hi += fmax(a, b);
+			}
+			minimum[i] = lo;
+			maximum[i] = hi;
+		}
+
+		return aabb(minimum, maximum);
+	}
+};
+
+//Applies b first, then a
+inline affine3 operator*(const affine3& a, const affine3& b)
+{
+	affine3 output;
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			output.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j] + (j == 3 ? a.m[i][3] : 0.0);
+		}
+	}
+
+	return output;
+}
+
+#endif
\ No newline at end of file
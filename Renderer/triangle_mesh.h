@@ -0,0 +1,297 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include "collection.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "linear_bvh.h"
+
+//Shear and scale that map a ray onto the +z axis, for the watertight triangle test (Woop, Benthin, Wald 2013).
+//Edges shared by two triangles are then evaluated identically for both, so rays cannot slip through a mesh between them
+struct watertight_ray
+{
+	watertight_ray(const ray& r)
+	{
+		const vec3& d = r.direction();
+		kz = fabs(d.x()) > fabs(d.y()) ? (fabs(d.x()) > fabs(d.z()) ? 0 : 2) : (fabs(d.y()) > fabs(d.z()) ? 1 : 2);
+		kx = (kz + 1) % 3;
+		ky = (kx + 1) % 3;
+		if (d[kz] < 0.0) std::swap(kx, ky); //keeps the winding, and so the signs of the edge functions
+
+		shear_x = d[kx] / d[kz];
+		shear_y = d[ky] / d[kz];
+		shear_z = 1.0 / d[kz];
+		origin = r.origin();
+	}
+
+	int kx, ky, kz;
+	double shear_x, shear_y, shear_z;
+	point3 origin;
+};
+
+//Where a mesh's arrays are, whether the mesh built them itself or they are read in place from a cache file
+struct mesh_arrays
+{
+	const point3* positions = nullptr;
+	const vec3* normals = nullptr; //one per vertex, or null for flat shading
+	const float* uvs = nullptr; //two per vertex, or null; hits then report barycentric coordinates
+	const uint32_t* indices = nullptr; //three per triangle, in the order of the BVH leaves
+	const linear_bvh_node* nodes = nullptr;
+	size_t vertex_count = 0;
+	size_t triangle_count = 0;
+	size_t node_count = 0;
+
+	size_t bytes() const
+	{
+		return vertex_count * (sizeof(point3) + (normals ? sizeof(vec3) : 0) + (uvs ? 2 * sizeof(float) : 0))
+			+ triangle_count * 3 * sizeof(uint32_t) + node_count * sizeof(linear_bvh_node);
+	}
+};
+
+//Indexed triangle mesh: the vertex attributes live in flat arrays shared by all triangles, and the mesh has its
+//own BVH over the triangle indices, so millions of triangles cost neither a hittable nor a shared_ptr each
+class triangle_mesh : public hittable
+{
+public:
+	triangle_mesh() {}
+	triangle_mesh(std::vector<point3> _positions, std::vector<uint32_t> _indices, shared_ptr<material> m,
+		std::vector<vec3> _normals = std::vector<vec3>(), std::vector<float> _uvs = std::vector<float>(),
+		const bvh_build_options& options = bvh_build_options(), bvh_stats* stats = nullptr);
+	//Uses arrays someone else built, storage keeps them alive (e.g. a mapped cache file)
+	triangle_mesh(const mesh_arrays& _arrays, shared_ptr<const void> _storage, shared_ptr<material> m);
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual void finalize(const ray& r, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+	size_t triangle_count() const { return arrays.triangle_count; }
+	size_t memory_bytes() const { return arrays.bytes(); }
+
+public:
+	mesh_arrays arrays;
+	shared_ptr<material> mat_ptr;
+	aabb box;
+
+private:
+	std::vector<point3> positions;
+	std::vector<vec3> normals;
+	std::vector<float> uvs;
+	std::vector<uint32_t> indices;
+	linear_bvh_node_array nodes;
+	shared_ptr<const void> storage;
+
+	bool intersect(const watertight_ray& wr, uint32_t triangle, double t_min, double t_max, double& t, double& b1, double& b2) const;
+};
+
+triangle_mesh::triangle_mesh(std::vector<point3> _positions, std::vector<uint32_t> _indices, shared_ptr<material> m,
+	std::vector<vec3> _normals, std::vector<float> _uvs, const bvh_build_options& options, bvh_stats* stats)
+	: mat_ptr(m), positions(std::move(_positions)), normals(std::move(_normals)), uvs(std::move(_uvs)), indices(std::move(_indices))
+{
+	size_t count = indices.size() / 3;
+	if (count == 0) return;
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	bvh_build_options leaf_options = options;
+	if (leaf_options.max_leaf_size > UINT16_MAX) leaf_options.max_leaf_size = UINT16_MAX;
+
+	std::vector<bvh_primitive> prims(count);
+	if (stats) stats->allocate(prims.capacity() * sizeof(bvh_primitive));
+	for (size_t i = 0; i < count; i++)
+	{
+		const point3& p0 = positions[indices[3 * i]];
+		const point3& p1 = positions[indices[3 * i + 1]];
+		const point3& p2 = positions[indices[3 * i + 2]];
+
+		auto& prim = prims[i];
+		prim.box = surrounding_box(aabb(p0, p0), surrounding_box(aabb(p1, p1), aabb(p2, p2))).conservative();
+		prim.centroid = prim.box.centroid();
+		prim.index = static_cast<uint32_t>(i);
+	}
+
+	nodes.reserve(2 * count - 1);
+	if (stats) stats->allocate(nodes.capacity() * sizeof(linear_bvh_node));
+	linear_bvh::build(prims, 0, count, leaf_options, stats, 0, bvh_parallel_depth(leaf_options), nodes);
+
+	//Leaves address the triangles in the order the build left the references in
+	std::vector<uint32_t> ordered(indices.size());
+	for (size_t i = 0; i < count; i++)
+	{
+		for (int k = 0; k < 3; k++) ordered[3 * i + k] = indices[3 * prims[i].index + k];
+	}
+	indices.swap(ordered);
+
+	//The reservation assumed single-triangle leaves; give the rest back once the references are gone
+	if (stats) stats->release(prims.capacity() * sizeof(bvh_primitive) + nodes.capacity() * sizeof(linear_bvh_node));
+	std::vector<bvh_primitive>().swap(prims);
+	linear_bvh_node_array(nodes.begin(), nodes.end()).swap(nodes);
+	if (stats) stats->allocate(nodes.capacity() * sizeof(linear_bvh_node));
+
+	arrays.positions = positions.data();
+	arrays.normals = normals.empty() ? nullptr : normals.data();
+	arrays.uvs = uvs.empty() ? nullptr : uvs.data();
+	arrays.indices = indices.data();
+	arrays.nodes = nodes.data();
+	arrays.vertex_count = positions.size();
+	arrays.triangle_count = count;
+	arrays.node_count = nodes.size();
+
+	box = aabb(
+		point3(nodes[0].bounds[0][0], nodes[0].bounds[0][1], nodes[0].bounds[0][2]),
+		point3(nodes[0].bounds[1][0], nodes[0].bounds[1][1], nodes[0].bounds[1][2]));
+
+	if (stats)
+	{
+		stats->finish(box);
+		stats->build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	}
+}
+
+triangle_mesh::triangle_mesh(const mesh_arrays& _arrays, shared_ptr<const void> _storage, shared_ptr<material> m)
+	: arrays(_arrays), mat_ptr(m), storage(std::move(_storage))
+{
+	if (arrays.node_count == 0) return;
+
+	const linear_bvh_node& root = arrays.nodes[0];
+	box = aabb(
+		point3(root.bounds[0][0], root.bounds[0][1], root.bounds[0][2]),
+		point3(root.bounds[1][0], root.bounds[1][1], root.bounds[1][2]));
+}
+
+inline bool triangle_mesh::intersect(const watertight_ray& wr, uint32_t triangle, double t_min, double t_max, double& t, double& b1, double& b2) const
+{
+	const vec3 a = arrays.positions[arrays.indices[3 * triangle]] - wr.origin;
+	const vec3 b = arrays.positions[arrays.indices[3 * triangle + 1]] - wr.origin;
+	const vec3 c = arrays.positions[arrays.indices[3 * triangle + 2]] - wr.origin;
+
+	//Vertices in the ray's sheared space, where the ray runs along +z from (0, 0)
+	const double ax = a[wr.kx] - wr.shear_x * a[wr.kz], ay = a[wr.ky] - wr.shear_y * a[wr.kz];
+	const double bx = b[wr.kx] - wr.shear_x * b[wr.kz], by = b[wr.ky] - wr.shear_y * b[wr.kz];
+	const double cx = c[wr.kx] - wr.shear_x * c[wr.kz], cy = c[wr.ky] - wr.shear_y * c[wr.kz];
+
+	//Scaled barycentric coordinates: the edge functions of the 2D triangle at the origin
+	const double u = cx * by - cy * bx;
+	const double v = ax * cy - ay * cx;
+	const double w = bx * ay - by * ax;
+	if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0)) return false;
+
+	const double det = u + v + w;
+	if (det == 0.0) return false; //the ray runs along the triangle's plane
+
+	const double scaled_t = u * wr.shear_z * a[wr.kz] + v * wr.shear_z * b[wr.kz] + w * wr.shear_z * c[wr.kz];
+	const double inv_det = 1.0 / det;
+	t = scaled_t * inv_det;
+	if (t < t_min || t > t_max) return false;
+
+	b1 = v * inv_det;
+	b2 = w * inv_det;
+	return true;
+}
+
+bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
+	return true;
+}
+
+bool triangle_mesh::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	const watertight_ray wr(r);
+	uint32_t closest_triangle = UINT32_MAX;
+	double closest_t = t_max, closest_b1 = 0.0, closest_b2 = 0.0;
+
+	traverse_linear_bvh(arrays.nodes, arrays.node_count, r, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest)
+	{
+		double t, b1, b2;
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			if (intersect(wr, i, t_min, closest, t, b1, b2))
+			{
+				closest = closest_t = t;
+				closest_triangle = i;
+				closest_b1 = b1;
+				closest_b2 = b2;
+			}
+		}
+		return false;
+	});
+
+	if (closest_triangle == UINT32_MAX) return false;
+
+	rec.t = closest_t;
+	rec.prim_id = closest_triangle;
+	rec.local[0] = closest_b1;
+	rec.local[1] = closest_b2;
+	rec.object = this;
+	rec.sampled_light = false;
+	return true;
+}
+
+void triangle_mesh::finalize(const ray& r, hit_record& rec) const
+{
+	const uint32_t triangle = rec.prim_id;
+	const double b1 = rec.local[0], b2 = rec.local[1];
+	const uint32_t i0 = arrays.indices[3 * triangle], i1 = arrays.indices[3 * triangle + 1], i2 = arrays.indices[3 * triangle + 2];
+	const point3& p0 = arrays.positions[i0];
+	const point3& p1 = arrays.positions[i1];
+	const point3& p2 = arrays.positions[i2];
+	const double b0 = 1.0 - b1 - b2;
+
+	rec.p = b0 * p0 + b1 * p1 + b2 * p2; //barycentric, no error growth with the distance along the ray
+	rec.p_scale = fmax(max_magnitude(p0), fmax(max_magnitude(p1), max_magnitude(p2)));
+	rec.set_face_normal(r, unit_vector(cross(p1 - p0, p2 - p0)));
+
+	if (arrays.normals)
+	{
+		//Kept on the side of the geometric normal that faces the ray, front_face stays the geometric one
+		vec3 shading = unit_vector(b0 * arrays.normals[i0] + b1 * arrays.normals[i1] + b2 * arrays.normals[i2]);
+		rec.normal = dot(shading, rec.normal) < 0.0 ? -shading : shading;
+	}
+
+	if (arrays.uvs)
+	{
+		rec.u = b0 * arrays.uvs[2 * i0] + b1 * arrays.uvs[2 * i1] + b2 * arrays.uvs[2 * i2];
+		rec.v = b0 * arrays.uvs[2 * i0 + 1] + b1 * arrays.uvs[2 * i1 + 1] + b2 * arrays.uvs[2 * i2 + 1];
+	}
+	else
+	{
+		rec.u = b1;
+		rec.v = b2;
+	}
+
+	rec.mat_ptr = mat_ptr.get();
+}
+
+bool triangle_mesh::occluded(const ray& r, double t_min, double t_max) const
+{
+	const watertight_ray wr(r);
+	bool hit_anything = false;
+
+	traverse_linear_bvh(arrays.nodes, arrays.node_count, r, t_min, t_max, [&](uint32_t first, uint32_t count, double& closest)
+	{
+		double t, b1, b2;
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			if (intersect(wr, i, t_min, closest, t, b1, b2)) return hit_anything = true;
+		}
+		return false;
+	});
+
+	return hit_anything;
+}
+
+bool triangle_mesh::bounding_box(double time0, double time1, aabb& output_box) const
+{
+	output_box = box;
+	return true;
+}
+
+#endif
\ No newline at end of file
@@ -4,23 +4,63 @@
 #include <cmath>
 #include <iostream>
 
+#ifdef RENDERER_SIMD_VEC3
+#include "simd.h"
+#endif
+
 using std::sqrt;
 
-class vec3
+//Defining RENDERER_SIMD_VEC3 pads vec3 to four lanes and runs its arithmetic on SSE/AVX registers.
+//16-byte alignment is only asked for where the heap provides it, i.e. on 64-bit targets
+#if defined(RENDERER_SIMD_VEC3) && (defined(_M_X64) || defined(__x86_64__))
+#define VEC3_ALIGN alignas(16)
+#else
+#define VEC3_ALIGN
+#endif
+
+class VEC3_ALIGN vec3
 {
 public:
+#ifdef RENDERER_SIMD_VEC3
+	vec3() : e{ 0, 0, 0, 0 } {}
+	vec3(real c) : e{ c, c, c, 0 } {}
+	vec3(real e0, real e1, real e2) : e{ e0, e1, e2, 0 } {}
+	explicit vec3(real4 lanes) { store4(e, lanes); }
+
+	real4 lanes() const { return load4(e); }
+#else
 	vec3() : e{ 0, 0, 0 } {}
-	vec3(double c) : e{ c, c, c } {}
-	vec3(double e0, double e1, double e2) : e{ e0, e1, e2 } {}
+	vec3(real c) : e{ c, c, c } {}
+	vec3(real e0, real e1, real e2) : e{ e0, e1, e2 } {}
+#endif
 
-	double x() const { return e[0]; }
-	double y() const { return e[1]; }
-	double z() const { return e[2]; }
+	real x() const { return e[0]; }
+	real y() const { return e[1]; }
+	real z() const { return e[2]; }
 
 	vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-	double operator[](int i) const { return e[i]; }
-	double& operator[](int i) { return e[i]; }
+	real operator[](int i) const { return e[i]; }
+	real& operator[](int i) { return e[i]; }
+
+#ifdef RENDERER_SIMD_VEC3
+	vec3& operator+=(const vec3& v)
+	{
+		store4(e, add4(lanes(), v.lanes()));
+		return *this;
+	}
 
+	vec3& operator-=(const vec3& v)
+	{
+		store4(e, sub4(lanes(), v.lanes()));
+		return *this;
+	}
+
+	vec3& operator*=(const real t)
+	{
+		store4(e, mul4(lanes(), set4(t)));
+		return *this;
+	}
+#else
 	vec3& operator+=(const vec3& v)
 	{
 		e[0] += v.e[0];
@@ -39,7 +79,7 @@ public:
 		return *this;
 	}
 
-	vec3& operator*=(const double t)
+	vec3& operator*=(const real t)
 	{
 		e[0] *= t;
 		e[1] *= t;
@@ -47,13 +87,14 @@ public:
 
 		return *this;
 	}
+#endif
 
-	vec3& operator/=(const double t)
+	vec3& operator/=(const real t)
 	{
 		return *this *= 1 / t;
 	}
 
-	vec3& operator^=(const double t)
+	vec3& operator^=(const real t) //no SIMD pow to lean on, only the colour filters use it
 	{
 		e[0] = pow(e[0], t);
 		e[1] = pow(e[1], t);
@@ -62,12 +103,17 @@ public:
 		return *this;
 	}
 
-	double length_squared() const
+	real length_squared() const
 	{
+#ifdef RENDERER_SIMD_VEC3
+		real4 v = lanes();
+		return hsum3(mul4(v, v));
+#else
 		return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
+#endif
 	}
 
-	double length() const
+	real length() const
 	{
 		return sqrt(length_squared());
 	}
@@ -80,16 +126,24 @@ public:
 
 	inline static vec3 random()
 	{
-		return vec3(random_double(), random_double(), random_double());
+		double r[3];
+		random_doubles(r, 3);
+		return vec3(r[0], r[1], r[2]);
 	}
 
-	inline static vec3 random(double min, double max)
+	inline static vec3 random(real min, real max)
 	{
-		return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+		double r[3];
+		random_doubles(r, 3);
+		return vec3(min + (max - min) * r[0], min + (max - min) * r[1], min + (max - min) * r[2]);
 	}
 
 public:
-	double e[3];
+#ifdef RENDERER_SIMD_VEC3
+	real e[4]; //the fourth lane stays 0
+#else
+	real e[3];
+#endif
 };
 
 //Type aliases for vec3
@@ -108,6 +162,61 @@ inline bool operator==(const vec3& u, const vec3& v)
 	return (u.e[0] == v.e[0]) && (u.e[1] == v.e[1]) && (u.e[2] == v.e[2]);
 }
 
+#ifdef RENDERER_SIMD_VEC3
+inline vec3 operator+(const vec3& u, const vec3& v)
+{
+	return vec3(add4(u.lanes(), v.lanes()));
+}
+
+inline vec3 operator-(const vec3& u, const vec3& v)
+{
+	return vec3(sub4(u.lanes(), v.lanes()));
+}
+
+inline vec3 operator*(const vec3& u, const vec3& v)
+{
+	return vec3(mul4(u.lanes(), v.lanes()));
+}
+
+inline vec3 operator*(real t, const vec3& v)
+{
+	return vec3(mul4(set4(t), v.lanes()));
+}
+
+inline vec3 operator*(const vec3& v, real t)
+{
+	return t * v;
+}
+
+inline vec3 operator/(const vec3& v, real t)
+{
+	return (real(1) / t) * v;
+}
+
+inline vec3 operator/(const vec3& u, const vec3& v)
+{
+	vec3 output(div4(u.lanes(), v.lanes()));
+	output.e[3] = 0; //0 / 0 in the padding
+	return output;
+}
+
+inline real dot(const vec3& u, const vec3& v)
+{
+	return hsum3(mul4(u.lanes(), v.lanes()));
+}
+
+inline vec3 cross(const vec3& u, const vec3& v)
+{
+	real4 a = u.lanes();
+	real4 b = v.lanes();
+	return vec3(sub4(mul4(yzx4(a), zxy4(b)), mul4(zxy4(a), yzx4(b))));
+}
+
+inline vec3 unit_vector(vec3 v)
+{
+	return vec3(mul4(v.lanes(), set4(real(1) / v.length())));
+}
+#else
 inline vec3 operator+(const vec3& u, const vec3& v)
 {
 	return vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
@@ -123,19 +232,19 @@ inline vec3 operator*(const vec3& u, const vec3& v)
 	return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vec3 operator*(double t, const vec3& v)
+inline vec3 operator*(real t, const vec3& v)
 {
 	return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-inline vec3 operator*(const vec3& v, double t)
+inline vec3 operator*(const vec3& v, real t)
 {
 	return t * v;
 }
 
-inline vec3 operator/(const vec3& v, double t)
+inline vec3 operator/(const vec3& v, real t)
 {
-	return (1.0 / t) * v;
+	return (real(1) / t) * v;
 }
 
 inline vec3 operator/(const vec3& u, const vec3& v)
@@ -143,7 +252,7 @@ inline vec3 operator/(const vec3& u, const vec3& v)
 	return vec3(u.e[0] / v.e[0], u.e[1] / v.e[1], u.e[2] / v.e[2]);
 }
 
-inline double dot(const vec3& u, const vec3& v)
+inline real dot(const vec3& u, const vec3& v)
 {
 	return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2];
 }
@@ -156,6 +265,7 @@ inline vec3 unit_vector(vec3 v)
 {
 	return v / v.length();
 }
+#endif
 
 inline vec3 random_in_unit_sphere() {
 	while (true) {
@@ -180,7 +290,9 @@ inline vec3 random_in_unit_disk()
 {
 	while (true)
 	{
-		auto p = vec3(random_double(-1.0, 1.0), random_double(-1.0, 1.0), 0.0);
+		double r[2];
+		random_doubles(r, 2);
+		auto p = vec3(2.0 * r[0] - 1.0, 2.0 * r[1] - 1.0, 0.0);
 		if (p.length_squared() > 1.0) continue;
 		return p;
 	}
@@ -191,7 +303,7 @@ inline vec3 reflect(const vec3& v, const vec3& n)
 	return v - 2.0 * dot(v, n) * n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) //only accepts unit vectors for "uv" and "n"
+inline vec3 refract(const vec3& uv, const vec3& n, real etai_over_etat) //only accepts unit vectors for "uv" and "n"
 {
 	auto cos_theta = fmin(dot(-uv, n), 1.0);
 	vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
@@ -199,13 +311,23 @@ inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) //only
 	return r_out_perp + r_out_paralell;
 }
 
-inline vec3 clamp(vec3 v, double min, double max)
+#ifdef RENDERER_SIMD_VEC3
+inline vec3 clamp(vec3 v, real min, real max)
+{
+	vec3 output(min4(max4(v.lanes(), set4(min)), set4(max)));
+	output.e[3] = 0;
+	return output;
+}
+#else
+inline vec3 clamp(vec3 v, real min, real max)
 {
-	v.e[0] = clamp(v.e[0], min, max);
-	v.e[1] = clamp(v.e[1], min, max);
-	v.e[2] = clamp(v.e[2], min, max);
+	//Widened so a float component cannot match this overload through the vec3(real) constructor
+	v.e[0] = real(clamp(double(v.e[0]), double(min), double(max)));
+	v.e[1] = real(clamp(double(v.e[1]), double(min), double(max)));
+	v.e[2] = real(clamp(double(v.e[2]), double(min), double(max)));
 
 	return v;
 }
+#endif
 
 #endif
\ No newline at end of file
@@ -0,0 +1,166 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+#include "collection.h"
+
+#include "integrator.h"
+#include "ray_sort.h"
+
+//A path in flight, with its own random stream: paths of many pixels are interleaved and reordered between
+//stages, so each carries its generator instead of sharing the thread's, and a path's samples do not depend
+//on which others it was traced with
+struct wavefront_path
+{
+	path_state state;
+	pcg32x4 rng;
+	uint32_t sample; //where its radiance goes when it ends
+};
+
+//The paths of one round of a tile's samples, and the pixel each belongs to. Only grows, so the paths'
+//generators are not constructed again for every round
+struct wavefront_batch
+{
+	std::vector<wavefront_path> paths;
+	std::vector<color> radiance;
+	std::vector<int> pixels;
+	size_t count = 0;
+};
+
+//Wavefront integrator: traces a whole batch of paths one segment at a time. Every round intersects all live
+//paths, retires the misses, sorts the hits by material type and shades them in that order,
+//so each stage runs one kind of work over many paths instead of one path through every kind of work.
+//With sort_rays, scattered rays are binned by origin cell and direction octant (ray_sort.h) before each round
+//intersects them; camera rays come in pixel order and are coherent already.
+//Stages pass indices into the batch; paths only move when they are binned. Holds its buffers between batches, one per thread
+class wavefront_integrator
+{
+public:
+	wavefront_integrator(const hittable& _world, const hittable_list& _lights, const color& _background, const path_settings& _settings, bool _sort_rays = false)
+		: world(_world), lights(_lights), background(_background), settings(_settings), sort_rays(_sort_rays)
+	{
+		if (!world.bounding_box(0.0, 1.0, sorter.bounds)) sort_rays = false;
+	}
+
+	//Traces count paths to their ends and writes each one's radiance to radiance[path.sample]
+	void trace(wavefront_path* paths, size_t count, color* radiance);
+
+private:
+	void sort(wavefront_path* paths);
+	void intersect(wavefront_path* paths);
+
+private:
+	const hittable& world;
+	const hittable_list& lights;
+	const color background;
+	const path_settings settings;
+	bool sort_rays;
+
+	ray_sorter sorter;
+	std::vector<wavefront_path> sorted; //live paths in key order, before they move back to the front of the batch
+	std::vector<uint32_t> queue; //paths still alive
+	std::vector<uint32_t> next;
+	std::vector<hit_record> recs; //per queue entry
+	std::vector<uint8_t> hits;
+	std::vector<uint8_t> kinds; //per queue entry, index of its material's type in types
+	std::vector<size_t> types; //material types seen so far, by typeid hash
+	std::vector<uint32_t> order; //queue entries that hit, grouped by material type
+};
+
+//Bins the live paths by their next rays and moves them to the front of the batch in that order: the later
+//stages walk the queue, and paths read in key order but scattered over the batch would undo what was gained.
+//Ended paths have handed in their radiance, their slots are free
+void wavefront_integrator::sort(wavefront_path* paths)
+{
+	sorter.sort(queue.data(), queue.size(), [&](uint32_t p) -> const ray& { return paths[p].state.current; });
+
+	sorted.resize(queue.size());
+	for (size_t i = 0; i < queue.size(); i++) sorted[i] = paths[queue[i]];
+	for (size_t i = 0; i < queue.size(); i++)
+	{
+		paths[i] = sorted[i];
+		queue[i] = static_cast<uint32_t>(i);
+	}
+}
+
+//Media draw random numbers while they are intersected, so every path brings its own generator here too
+void wavefront_integrator::intersect(wavefront_path* paths)
+{
+	pcg32x4& thread_generator = thread_rng();
+	recs.resize(queue.size());
+	hits.resize(queue.size());
+
+	for (size_t i = 0; i < queue.size(); i++)
+	{
+		wavefront_path& path = paths[queue[i]];
+		std::swap(thread_generator, path.rng);
+		hits[i] = world.hit(path.state.current, 0.0, infinity, recs[i]);
+		std::swap(thread_generator, path.rng);
+	}
+}
+
+void wavefront_integrator::trace(wavefront_path* paths, size_t count, color* radiance)
+{
+	pcg32x4& thread_generator = thread_rng();
+
+	queue.resize(count);
+	for (size_t i = 0; i < count; i++) queue[i] = static_cast<uint32_t>(i);
+
+	for (int round = 0; !queue.empty(); round++)
+	{
+		if (sort_rays && round > 0) sort(paths);
+		intersect(paths);
+
+		//Misses end here, the rest are shaded grouped by material type. A scene has a handful of types, so a
+		//counting sort does it; it is stable, and within a type the paths stay in the order their pixels came in
+		std::array<uint32_t, 256> type_start = {};
+		kinds.resize(queue.size());
+		for (size_t i = 0; i < queue.size(); i++)
+		{
+			if (!hits[i])
+			{
+				wavefront_path& path = paths[queue[i]];
+				path_segment(path.state, false, recs[i], background, world, lights, settings);
+				radiance[path.sample] = path.state.radiance;
+				continue;
+			}
+
+			size_t type = typeid(*recs[i].mat_ptr).hash_code();
+			size_t kind = 0;
+			while (kind < types.size() && types[kind] != type) kind++;
+			if (kind == types.size() && types.size() < type_start.size() - 1) types.push_back(type);
+			kinds[i] = static_cast<uint8_t>((std::min)(kind, type_start.size() - 2)); //types past the table share its last slot
+			type_start[kinds[i] + 1]++;
+		}
+		for (size_t k = 1; k < type_start.size(); k++) type_start[k] += type_start[k - 1];
+
+		order.resize(type_start.back());
+		for (size_t i = 0; i < queue.size(); i++)
+		{
+			if (hits[i]) order[type_start[kinds[i]]++] = static_cast<uint32_t>(i);
+		}
+
+		next.clear();
+		for (uint32_t entry : order)
+		{
+			wavefront_path& path = paths[queue[entry]];
+
+			//Materials draw from the thread's generator, the path's own stands in for it while it is shaded
+			std::swap(thread_generator, path.rng);
+			bool alive = path_segment(path.state, true, recs[entry], background, world, lights, settings);
+			std::swap(thread_generator, path.rng);
+
+			if (alive) next.push_back(queue[entry]);
+			else radiance[path.sample] = path.state.radiance;
+		}
+
+		queue.swap(next);
+	}
+}
+
+#endif
\ No newline at end of file
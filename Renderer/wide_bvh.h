@@ -0,0 +1,432 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <cstdint>
+#include <vector>
+#include <xmmintrin.h>
+#include "collection.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+
+//Four-wide bounding volume hierarchy collapsed from the binary linear_bvh. Every node keeps its children's
+//boxes side by side, so a ray is tested against all four with one run of SSE instructions and the tree is
+//about half as deep
+
+struct alignas(64) bvh4_node
+{
+	float bounds[2][3][4]; //[min/max][axis][child]
+	uint32_t offset[4]; //leaf child: first object in the ordered array; interior child: node index
+	uint16_t object_count[4]; //0 for interior children
+	uint32_t child_count;
+};
+
+static_assert(sizeof(bvh4_node) == 128, "bvh4_node should fill two cache lines");
+
+class bvh4 : public hittable
+{
+public:
+	bvh4() {}
+	bvh4(const hittable_list& list, double time0, double time1, const bvh_build_options& options = bvh_build_options(), bvh_stats* stats = nullptr);
+
+	virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool intersect(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+	virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+	virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+	virtual void gather_lights(hittable_list& lights) const override;
+
+	void hit4(const ray* rays, int count, double t_min, double t_max, hit_record* recs, bool* hits) const;
+
+public:
+	std::vector<bvh4_node, aligned_allocator<bvh4_node>> nodes;
+	std::vector<shared_ptr<hittable>> objects; //same order as the binary tree's leaves
+	aabb box;
+
+private:
+	uint32_t collapse(const linear_bvh& binary, uint32_t binary_index);
+};
+
+//Every wide node takes at least one level of the binary tree it is collapsed from, so there are at most
+//bvh_max_depth levels of them. Visiting a node pops one entry and pushes up to four, so a stack of this size holds
+//everything pending along the deepest path
+const int bvh4_stack_size = 3 * bvh_max_depth + 1;
+
+//Slab tests are done in float. The ray origin is rounded outwards (float_bounds()), so boxes are never shifted off
+//the double ray; the subtraction, the product and inv_dir's rounding each make t off by up to half an ulp, so every
+//slab's far distance is widened by this, over twice their sum, and the node holding the closest hit is never culled
+const float bvh4_far_slack = 1.0000006f;
+
+//Floats at or below and at or above x. Stepping a whole ulp or more out from the nearest float, instead of going to
+//the adjacent one with std::nextafter, keeps this free of branches and library calls
+inline void float_bounds(double x, float& below, float& above)
+{
+	float nearest = static_cast<float>(x);
+	float step = std::fabs(nearest) * std::numeric_limits<float>::epsilon() + (std::numeric_limits<float>::min)();
+	below = nearest - step;
+	above = nearest + step;
+}
+
+//Float copies of a ray's origin rounded down and up, as in the slab test: the low bounds of boxes are taken from the
+//upper origin and the high bounds from the lower one, which tests the box grown by the origin's rounding
+inline void float_origin(const ray& r, __m128 origin_below[3], __m128 origin_above[3])
+{
+	for (int a = 0; a < 3; a++)
+	{
+		float below, above;
+		float_bounds(r.origin()[a], below, above);
+		origin_below[a] = _mm_set1_ps(below);
+		origin_above[a] = _mm_set1_ps(above);
+	}
+}
+
+bvh4::bvh4(const hittable_list& list, double time0, double time1, const bvh_build_options& options, bvh_stats* stats)
+{
+	linear_bvh binary(list, time0, time1, options, stats);
+	if (binary.nodes.empty()) return;
+
+	nodes.reserve(binary.nodes.size() / 2 + 1);
+	collapse(binary, 0);
+	objects = std::move(binary.objects);
+	box = binary.box;
+
+	if (stats)
+	{
+		stats->allocate(nodes.capacity() * sizeof(bvh4_node));
+		stats->release(binary.nodes.capacity() * sizeof(linear_bvh_node));
+	}
+}
+
+//Turns the binary subtree at binary_index into a wide node: starting from the subtree itself, the interior child
+//with the largest surface area is replaced by its two children until there are four
+uint32_t bvh4::collapse(const linear_bvh& binary, uint32_t binary_index)
+{
+	auto area = [&](uint32_t i)
+	{
+		const auto& b = binary.nodes[i].bounds;
+		float dx = b[1][0] - b[0][0], dy = b[1][1] - b[0][1], dz = b[1][2] - b[0][2];
+		return dx * dy + dy * dz + dz * dx;
+	};
+
+	uint32_t children[4] = { binary_index };
+	int child_count = 1;
+	while (child_count < 4)
+	{
+		int widest = -1;
+		for (int c = 0; c < child_count; c++)
+		{
+			if (binary.nodes[children[c]].object_count > 0) continue;
+			if (widest < 0 || area(children[c]) > area(children[widest])) widest = c;
+		}
+		if (widest < 0) break;
+
+		uint32_t opened = children[widest];
+		children[widest] = opened + 1; //first child follows its parent
+		children[child_count++] = binary.nodes[opened].offset;
+	}
+
+	uint32_t index = static_cast<uint32_t>(nodes.size());
+	nodes.emplace_back();
+	nodes[index].child_count = child_count;
+
+	for (int c = 0; c < 4; c++)
+	{
+		bool used = c < child_count;
+		for (int a = 0; a < 3; a++)
+		{
+			//Unused slots are masked out by child_count, their boxes are never read
+			nodes[index].bounds[0][a][c] = used ? binary.nodes[children[c]].bounds[0][a] : 0.0f;
+			nodes[index].bounds[1][a][c] = used ? binary.nodes[children[c]].bounds[1][a] : 0.0f;
+		}
+		nodes[index].offset[c] = 0;
+		nodes[index].object_count[c] = 0;
+	}
+
+	for (int c = 0; c < child_count; c++)
+	{
+		const auto& child = binary.nodes[children[c]];
+		if (child.object_count > 0)
+		{
+			nodes[index].offset[c] = child.offset;
+			nodes[index].object_count[c] = child.object_count;
+		}
+		else
+		{
+			uint32_t child_index = collapse(binary, children[c]); //nodes may reallocate in here
+			nodes[index].offset[c] = child_index;
+		}
+	}
+
+	return index;
+}
+
+bool bvh4::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	if (!intersect(r, t_min, t_max, rec)) return false;
+
+	finalize_hit(r, rec);
+	return true;
+}
+
+bool bvh4::intersect(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+	counted_query query(1);
+	if (nodes.empty()) return false;
+
+	__m128 origin_below[3], origin_above[3];
+	float_origin(r, origin_below, origin_above);
+	const __m128 inv_dir[3] = { _mm_set1_ps(static_cast<float>(r.inv_dir.x())), _mm_set1_ps(static_cast<float>(r.inv_dir.y())), _mm_set1_ps(static_cast<float>(r.inv_dir.z())) };
+	const __m128 near_t = _mm_set1_ps(static_cast<float>(t_min));
+	const __m128 slack = _mm_set1_ps(bvh4_far_slack);
+	__m128 far_t = _mm_set1_ps(static_cast<float>(t_max) * bvh4_far_slack);
+
+	struct entry
+	{
+		uint32_t offset;
+		uint16_t object_count; //0 for nodes
+		float t; //where the ray enters the entry's box
+	};
+
+	entry to_visit[bvh4_stack_size];
+	int to_visit_count = 0;
+	to_visit[to_visit_count++] = { 0, 0, static_cast<float>(t_min) };
+	bool hit_anything = false;
+
+	while (to_visit_count > 0)
+	{
+		entry current = to_visit[--to_visit_count];
+		if (current.t > static_cast<float>(t_max) * bvh4_far_slack) continue; //a closer hit turned up since it was pushed
+
+		if (current.object_count > 0)
+		{
+			count_primitive_tests(current.object_count);
+			for (uint32_t i = current.offset; i < current.offset + current.object_count; i++)
+			{
+				if (objects[i]->intersect(r, t_min, t_max, rec))
+				{
+					hit_anything = true;
+					t_max = rec.t;
+					if (objects[i]->emissive()) rec.sampled_light = true; //gather_lights() lists it
+				}
+			}
+			far_t = _mm_set1_ps(static_cast<float>(t_max) * bvh4_far_slack);
+			continue;
+		}
+
+		const bvh4_node& node = nodes[current.offset];
+		count_node_fetch(&node);
+		__m128 t0 = near_t, t1 = far_t;
+		for (int a = 0; a < 3; a++)
+		{
+			__m128 lo = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[0][a]), origin_above[a]), inv_dir[a]);
+			__m128 hi = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1][a]), origin_below[a]), inv_dir[a]);
+			t0 = _mm_max_ps(_mm_min_ps(lo, hi), t0); //operands ordered so a NaN slab (0 * inf) leaves the interval as it was
+			t1 = _mm_min_ps(_mm_mul_ps(_mm_max_ps(lo, hi), slack), t1);
+		}
+		int mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << node.child_count) - 1);
+		if (!mask) continue;
+
+		alignas(16) float entry_t[4];
+		_mm_store_ps(entry_t, t0);
+
+		//Push the children farthest first, so the nearest is visited next
+		int first = to_visit_count;
+		for (int c = 0; c < 4; c++)
+		{
+			if (!(mask & (1 << c))) continue;
+
+			entry e = { node.offset[c], node.object_count[c], entry_t[c] };
+			int k = to_visit_count++;
+			while (k > first && to_visit[k - 1].t < e.t)
+			{
+				to_visit[k] = to_visit[k - 1];
+				k--;
+			}
+			to_visit[k] = e;
+		}
+	}
+
+	return hit_anything;
+}
+
+//Any hit ends the query, so children are visited in whatever order they come and the far distance never shrinks
+bool bvh4::occluded(const ray& r, double t_min, double t_max) const
+{
+	counted_query query(1);
+	if (nodes.empty()) return false;
+
+	__m128 origin_below[3], origin_above[3];
+	float_origin(r, origin_below, origin_above);
+	const __m128 inv_dir[3] = { _mm_set1_ps(static_cast<float>(r.inv_dir.x())), _mm_set1_ps(static_cast<float>(r.inv_dir.y())), _mm_set1_ps(static_cast<float>(r.inv_dir.z())) };
+	const __m128 near_t = _mm_set1_ps(static_cast<float>(t_min));
+	const __m128 slack = _mm_set1_ps(bvh4_far_slack);
+	const __m128 far_t = _mm_set1_ps(static_cast<float>(t_max) * bvh4_far_slack);
+
+	struct entry
+	{
+		uint32_t offset;
+		uint16_t object_count; //0 for nodes
+	};
+
+	entry to_visit[bvh4_stack_size];
+	int to_visit_count = 0;
+	to_visit[to_visit_count++] = { 0, 0 };
+
+	while (to_visit_count > 0)
+	{
+		entry current = to_visit[--to_visit_count];
+
+		if (current.object_count > 0)
+		{
+			count_primitive_tests(current.object_count);
+			for (uint32_t i = current.offset; i < current.offset + current.object_count; i++)
+			{
+				if (objects[i]->occluded(r, t_min, t_max)) return true;
+			}
+			continue;
+		}
+
+		const bvh4_node& node = nodes[current.offset];
+		count_node_fetch(&node);
+		__m128 t0 = near_t, t1 = far_t;
+		for (int a = 0; a < 3; a++)
+		{
+			__m128 lo = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[0][a]), origin_above[a]), inv_dir[a]);
+			__m128 hi = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1][a]), origin_below[a]), inv_dir[a]);
+			t0 = _mm_max_ps(_mm_min_ps(lo, hi), t0);
+			t1 = _mm_min_ps(_mm_mul_ps(_mm_max_ps(lo, hi), slack), t1);
+		}
+		int mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & ((1 << node.child_count) - 1);
+
+		for (int c = 0; c < 4; c++)
+		{
+			if (mask & (1 << c)) to_visit[to_visit_count++] = { node.offset[c], node.object_count[c] };
+		}
+	}
+
+	return false;
+}
+
+//Closest hits of up to four rays in one traversal, each child box is tested against all of them at once.
+//Meant for coherent rays such as one pixel's camera samples
+void bvh4::hit4(const ray* rays, int count, double t_min, double t_max, hit_record* recs, bool* hits) const
+{
+	for (int k = 0; k < count; k++) hits[k] = false;
+	counted_query query(count > 0 ? count : 0);
+	if (nodes.empty() || count <= 0) return;
+
+	alignas(16) float lanes[10][4]; //origin rounded down xyz, up xyz, inverse direction xyz, far distance
+	double closest[4];
+	for (int k = 0; k < 4; k++)
+	{
+		bool active = k < count;
+		for (int a = 0; a < 3; a++)
+		{
+			if (active) float_bounds(rays[k].origin()[a], lanes[a][k], lanes[3 + a][k]);
+			else lanes[a][k] = lanes[3 + a][k] = 0.0f;
+			lanes[6 + a][k] = active ? static_cast<float>(rays[k].inv_dir[a]) : 1.0f;
+		}
+		closest[k] = t_max;
+		lanes[9][k] = active ? static_cast<float>(t_max) * bvh4_far_slack : -std::numeric_limits<float>::infinity(); //padding lanes never hit
+	}
+
+	const __m128 origin_below[3] = { _mm_load_ps(lanes[0]), _mm_load_ps(lanes[1]), _mm_load_ps(lanes[2]) };
+	const __m128 origin_above[3] = { _mm_load_ps(lanes[3]), _mm_load_ps(lanes[4]), _mm_load_ps(lanes[5]) };
+	const __m128 inv_dir[3] = { _mm_load_ps(lanes[6]), _mm_load_ps(lanes[7]), _mm_load_ps(lanes[8]) };
+	const __m128 near_t = _mm_set1_ps(static_cast<float>(t_min));
+	const __m128 slack = _mm_set1_ps(bvh4_far_slack);
+	__m128 far_t = _mm_load_ps(lanes[9]);
+
+	struct entry
+	{
+		uint32_t offset;
+		uint16_t object_count; //0 for nodes
+		uint16_t ray_mask; //rays whose slab test reached the entry
+		float t; //where the first of them enters its box
+	};
+
+	entry to_visit[bvh4_stack_size];
+	int to_visit_count = 0;
+	to_visit[to_visit_count++] = { 0, 0, static_cast<uint16_t>((1 << count) - 1), static_cast<float>(t_min) };
+
+	while (to_visit_count > 0)
+	{
+		entry current = to_visit[--to_visit_count];
+
+		if (current.object_count > 0)
+		{
+			for (int k = 0; k < count; k++)
+			{
+				if (!(current.ray_mask & (1 << k))) continue;
+
+				count_primitive_tests(current.object_count);
+				for (uint32_t i = current.offset; i < current.offset + current.object_count; i++)
+				{
+					if (objects[i]->intersect(rays[k], t_min, closest[k], recs[k]))
+					{
+						hits[k] = true;
+						closest[k] = recs[k].t;
+						if (objects[i]->emissive()) recs[k].sampled_light = true;
+						lanes[9][k] = static_cast<float>(closest[k]) * bvh4_far_slack;
+					}
+				}
+			}
+			far_t = _mm_load_ps(lanes[9]);
+			continue;
+		}
+
+		const bvh4_node& node = nodes[current.offset];
+		count_node_fetch(&node);
+		int first = to_visit_count;
+		for (int c = 0; c < static_cast<int>(node.child_count); c++)
+		{
+			__m128 t0 = near_t, t1 = far_t;
+			for (int a = 0; a < 3; a++)
+			{
+				__m128 lo = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds[0][a][c]), origin_above[a]), inv_dir[a]);
+				__m128 hi = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds[1][a][c]), origin_below[a]), inv_dir[a]);
+				t0 = _mm_max_ps(_mm_min_ps(lo, hi), t0);
+				t1 = _mm_min_ps(_mm_mul_ps(_mm_max_ps(lo, hi), slack), t1);
+			}
+			int mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+			if (!mask) continue;
+
+			alignas(16) float entry_t[4];
+			_mm_store_ps(entry_t, t0);
+			float nearest = infinity;
+			for (int k = 0; k < count; k++) if (mask & (1 << k)) nearest = fmin(nearest, entry_t[k]);
+
+			//Farthest first, as in hit()
+			entry e = { node.offset[c], node.object_count[c], static_cast<uint16_t>(mask), nearest };
+			int k = to_visit_count++;
+			while (k > first && to_visit[k - 1].t < e.t)
+			{
+				to_visit[k] = to_visit[k - 1];
+				k--;
+			}
+			to_visit[k] = e;
+		}
+	}
+
+	for (int k = 0; k < count; k++)
+	{
+		if (hits[k]) finalize_hit(rays[k], recs[k]);
+	}
+}
+
+bool bvh4::bounding_box(double time0, double time1, aabb& output_box) const
+{
+	output_box = box;
+	return true;
+}
+
+void bvh4::gather_lights(hittable_list& lights) const
+{
+	for (const auto& object : objects)
+	{
+		if (object->emissive()) lights.add(object);
+		else object->gather_lights(lights);
+	}
+}
+
+#endif
\ No newline at end of file